@@ -26,6 +26,21 @@ public:
     static const nt::NTTable::ColumnSpec NANOSECONDS;
     static const nt::NTTable::ColumnSpec PULSE_ID;
 
+    // Merged tables may pack the validity of their inputs into bitmap columns,
+    // named VALIDITY_PREFIX, a separator and a group index. Bit b of group g
+    // is set if input (VALIDITY_BITS*g + b) has data in that row.
+    typedef uint64_t VALIDITY_T;
+    static const std::string VALIDITY_PREFIX;
+    static const size_t VALIDITY_BITS = 64;
+
+    // Merged tables may publish the columns of some inputs sparsely: only the rows
+    // where the input has data, plus a column, named like the input's other columns
+    // but ending in SPARSE_ROWS_COL, with the table row of each of them. Columns of
+    // such an input are either as long as the table (dense, SPARSE_ROWS_COL column
+    // is empty) or as long as their SPARSE_ROWS_COL column (sparse).
+    typedef uint32_t SPARSE_ROW_T;
+    static const std::string SPARSE_ROWS_COL;
+
     const std::vector<nt::NTTable::ColumnSpec> columns;
     const std::vector<nt::NTTable::ColumnSpec> time_columns;
     const std::vector<nt::NTTable::ColumnSpec> data_columns;
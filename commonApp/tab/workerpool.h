@@ -0,0 +1,75 @@
+#ifndef TAB_WORKERPOOL_H
+#define TAB_WORKERPOOL_H
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <exception>
+#include <functional>
+
+#include <epicsEvent.h>
+#include <epicsMutex.h>
+#include <epicsThread.h>
+
+namespace tabulator {
+
+/* WorkerPool
+ *
+ * A fixed set of threads that cooperatively run the iterations of a loop.
+ * Iterations are handed out one at a time from a shared counter, so a
+ * thread that finishes early keeps taking work that would otherwise wait
+ * behind a slow one. The calling thread also takes part, so a pool of
+ * `num_threads` starts `num_threads - 1` extra threads. With less than two
+ * threads, loops simply run on the calling thread.
+ */
+class WorkerPool {
+
+public:
+    typedef std::function<void(size_t /* iteration index */)> TaskFunc;
+
+private:
+    class Worker : public epicsThreadRunable {
+        WorkerPool & pool_;
+
+    public:
+        epicsEvent wakeup_;
+        epicsThread thread_;
+
+        Worker(WorkerPool & pool);
+        virtual void run();
+        virtual ~Worker() {}
+    };
+
+    epicsMutex lock_;
+    epicsEvent done_;
+    std::vector<std::unique_ptr<Worker>> workers_;
+    bool running_;
+
+    // Current loop. Only changed while no worker is busy.
+    const TaskFunc *task_;
+    size_t num_tasks_;
+    std::atomic<size_t> next_task_;
+    size_t busy_;
+    std::exception_ptr error_;
+
+    void run_tasks();
+    void work(Worker & worker);
+
+public:
+    WorkerPool(size_t num_threads);
+    ~WorkerPool();
+
+    /* Number of threads (including the caller) that run loops */
+    size_t size() const;
+
+    /* Runs `f(i)` for every `i` in [0, n), returning when all are done.
+     * If any iteration throws, the first exception is rethrown here once
+     * all other iterations are done.
+     * Must not be called concurrently, nor from within `f`.
+     */
+    void parallel_for(size_t n, const TaskFunc & f);
+};
+
+}
+
+#endif
@@ -1,7 +1,7 @@
 #include "tab/timetable.h"
 
 #include <map>
-#include <set>
+#include <vector>
 
 #include <pvxs/log.h>
 
@@ -26,6 +26,10 @@ COLSPEC(TimeTable::NANOSECONDS,        TypeCode::UInt32A, "nanoseconds");
 COLSPEC(TimeTable::PULSE_ID,           TypeCode::UInt64A, "pulseId");
 static const size_t NUM_TIME_COLS = 3;
 
+const std::string TimeTable::VALIDITY_PREFIX("validity");
+const size_t TimeTable::VALIDITY_BITS;
+const std::string TimeTable::SPARSE_ROWS_COL("sparseRows");
+
 COLSPEC(TimeTableScalar::VALUE,        TypeCode::Float64A, "value");
 COLSPEC(TimeTableScalar::UTAG,         TypeCode::UInt64A,  "utag");
 COLSPEC(TimeTableScalar::ALARM_SEV,    TypeCode::UInt16A,  "severity");
@@ -147,8 +151,8 @@ bool TimeTable::is_valid(const pvxs::Value & value) const {
         return false;
     }
 
-    // Column length -> list of column names with the same column length
-    std::set<size_t> vcolumn_lengths;
+    // Length of each column
+    std::vector<size_t> vcolumn_lengths;
 
     // Column name and type and label must match, in order (overly strict for now)
     auto vcolumns_it = vcolumns_field.ichildren();
@@ -179,15 +183,44 @@ bool TimeTable::is_valid(const pvxs::Value & value) const {
         }
 
         auto vcolumn_value = (*it).as<pvxs::shared_array<const void>>();
-        vcolumn_lengths.insert(vcolumn_value.size());
+        vcolumn_lengths.push_back(vcolumn_value.size());
     }
 
-    // All columns must have the same length
-    if (vcolumn_lengths.size() > 1) {
-        log_warn_printf(LOG, "is_valid: expected all columns to have the same number of rows, but there are %lu different lengths\n",
-            vcolumn_lengths.size()
-        );
-        return false;
+    // Columns of sparse inputs may also be as long as their sparse rows column.
+    // Column name prefix -> length of the sparse rows column
+    std::map<std::string, size_t> sparse_lengths;
+
+    for (idx = NUM_TIME_COLS; idx < columns.size(); ++idx) {
+        const auto & name = columns[idx].name;
+
+        if (name.size() > SPARSE_ROWS_COL.size() &&
+            name.compare(name.size() - SPARSE_ROWS_COL.size(), SPARSE_ROWS_COL.size(), SPARSE_ROWS_COL) == 0)
+            sparse_lengths[name.substr(0, name.size() - SPARSE_ROWS_COL.size())] = vcolumn_lengths[idx];
+    }
+
+    // All other columns must have the same length
+    size_t num_rows = vcolumn_lengths.front();
+
+    for (idx = 0; idx < columns.size(); ++idx) {
+        if (vcolumn_lengths[idx] == num_rows)
+            continue;
+
+        const auto & name = columns[idx].name;
+        bool sparse = false;
+
+        for (const auto & s : sparse_lengths) {
+            if (name.compare(0, s.first.size(), s.first) == 0 && vcolumn_lengths[idx] == s.second) {
+                sparse = true;
+                break;
+            }
+        }
+
+        if (!sparse) {
+            log_warn_printf(LOG, "is_valid: expected column '%s' to have %lu rows, but it has %lu\n",
+                name.c_str(), num_rows, vcolumn_lengths[idx]
+            );
+            return false;
+        }
     }
 
     return true;
@@ -0,0 +1,116 @@
+#include "tab/workerpool.h"
+
+typedef epicsGuard<epicsMutex> Guard;
+
+namespace tabulator {
+
+WorkerPool::Worker::Worker(WorkerPool & pool)
+: pool_(pool), wakeup_(),
+  thread_(*this, "WorkerPool", epicsThreadGetStackSize(epicsThreadStackMedium), epicsThreadPriorityMedium)
+{}
+
+void WorkerPool::Worker::run() {
+    pool_.work(*this);
+}
+
+WorkerPool::WorkerPool(size_t num_threads)
+: lock_(), done_(), workers_(), running_(true),
+  task_(nullptr), num_tasks_(0), next_task_(0), busy_(0), error_()
+{
+    for (size_t i = 1; i < num_threads; ++i) {
+        workers_.emplace_back(new Worker(*this));
+        workers_.back()->thread_.start();
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        Guard G(lock_);
+        running_ = false;
+    }
+
+    for (auto & worker : workers_) {
+        worker->wakeup_.signal();
+        worker->thread_.exitWait();
+    }
+}
+
+size_t WorkerPool::size() const {
+    return workers_.size() + 1;
+}
+
+void WorkerPool::run_tasks() {
+    size_t idx;
+
+    while ((idx = next_task_++) < num_tasks_) {
+        try {
+            (*task_)(idx);
+        } catch (...) {
+            Guard G(lock_);
+            if (!error_)
+                error_ = std::current_exception();
+        }
+    }
+}
+
+void WorkerPool::work(Worker & worker) {
+    for (;;) {
+        worker.wakeup_.wait();
+
+        {
+            Guard G(lock_);
+            if (!running_)
+                return;
+        }
+
+        run_tasks();
+
+        Guard G(lock_);
+        if (--busy_ == 0)
+            done_.signal();
+    }
+}
+
+void WorkerPool::parallel_for(size_t n, const TaskFunc & f) {
+    if (workers_.empty() || n < 2) {
+        for (size_t i = 0; i < n; ++i)
+            f(i);
+        return;
+    }
+
+    {
+        Guard G(lock_);
+        task_ = &f;
+        num_tasks_ = n;
+        next_task_ = 0;
+        busy_ = workers_.size();
+        error_ = nullptr;
+    }
+
+    for (auto & worker : workers_)
+        worker->wakeup_.signal();
+
+    run_tasks();
+
+    // Wait for the workers to be done with this loop
+    for (;;) {
+        {
+            Guard G(lock_);
+            if (busy_ == 0)
+                break;
+        }
+        done_.wait();
+    }
+
+    std::exception_ptr error;
+    {
+        Guard G(lock_);
+        error.swap(error_);
+        task_ = nullptr;
+    }
+
+    if (error)
+        std::rethrow_exception(error);
+}
+
+}
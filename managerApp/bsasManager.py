@@ -711,17 +711,20 @@ class Watcher():
                 # the input file has changed from its previous state, or (3)
                 # the contents have been seen for the first time.
                 #
-                # If the merger software is already working, we need to restart
-                # only it.  A writer process running on this same or any other
-                # machine will stop when the NTTable it is monitoring
-                # disconnects, then the thread in which it was started will
-                # restart it.
+                # If the merger software is already working, it is asked to
+                # reload the PV list (SIGHUP), keeping the data of the
+                # unchanged PVs.  The merger waits for the added PVs to join
+                # (or a deadline), then publishes the new NTTable shape once,
+                # by closing and reopening its output PV.  A writer process
+                # running on this same or any other machine stops on that
+                # disconnect, then the thread in which it was started
+                # restarts it.
                 #
                 if self._opt.useMerger:
                         if self._mergerThread is None:
                                 self._startMergerProcess()
                         else:
-                                self._mergerThread.signalProcess()
+                                self._mergerThread.signalProcess( signal.SIGHUP)
 
                 if self._opt.useWriter:
                         if self._writerThread is None:
@@ -843,8 +846,8 @@ class Watcher():
 
                         return
 
-                def signalProcess( self):
-                        """ Send the terminate signal to the process started by this thread, which our run method will then restart
+                def signalProcess( self, signum: int = signal.SIGTERM):
+                        """ Send a signal to the process started by this thread.  By default, the terminate signal, after which our run method will restart the process
                         """
 
                         #
@@ -858,9 +861,9 @@ class Watcher():
                         self._mutex.acquire()
                         if self._processHandle != None:
                                 try:
-                                        self._processHandle.send_signal( signal.SIGTERM)
+                                        self._processHandle.send_signal( signum)
                                 except OSError as e:
-                                        self._parent._log.debug( 'Cannot terminate a process: Error {}: {}'.format( e, repr( e)))
+                                        self._parent._log.debug( 'Cannot signal a process: Error {}: {}'.format( e, repr( e)))
                         else:
                                 self._parent._log.debug( 'The process has already stopped, no need to send signal.')
                         self._mutex.release()
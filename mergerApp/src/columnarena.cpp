@@ -0,0 +1,183 @@
+#include "columnarena.h"
+
+#include <new>
+#include <algorithm>
+#include <string>
+#include <stdexcept>
+#include <type_traits>
+
+typedef epicsGuard<epicsMutex> Guard;
+
+namespace tabulator {
+
+// Memory blocks of 2^SIZE_CLASSES bytes and more aren't pooled
+static const size_t SIZE_CLASSES = 48;
+
+class ColumnArena::Pool {
+private:
+    struct SizeClass {
+        std::vector<void*> free;    // Blocks ready for reuse
+        size_t used;                // Blocks handed out during the current generation
+        size_t used_before;         // Blocks handed out during the previous generation
+
+        SizeClass() : free(), used(0), used_before(0) {}
+    };
+
+    mutable epicsMutex lock_;
+    std::vector<SizeClass> classes_;
+    Stats stats_;
+
+public:
+    // Gives a block back to its pool once the array using it goes away
+    struct Return {
+        std::shared_ptr<Pool> pool;
+        size_t cls;
+
+        void operator()(void *block) const {
+            pool->release(block, cls);
+        }
+    };
+
+    Pool() : lock_(), classes_(SIZE_CLASSES), stats_() {}
+
+    ~Pool() {
+        for (auto & cls : classes_)
+            for (auto block : cls.free)
+                ::operator delete(block);
+    }
+
+    static size_t class_of(size_t bytes) {
+        size_t cls = 0;
+        while ((size_t(1) << cls) < bytes)
+            ++cls;
+        return cls;
+    }
+
+    static size_t class_bytes(size_t cls) {
+        return size_t(1) << cls;
+    }
+
+    void * acquire(size_t cls) {
+        {
+            Guard G(lock_);
+            auto & sc = classes_[cls];
+            ++sc.used;
+
+            if (!sc.free.empty()) {
+                void *block = sc.free.back();
+                sc.free.pop_back();
+                stats_.cached_bytes -= class_bytes(cls);
+                ++stats_.reuses;
+                return block;
+            }
+
+            ++stats_.allocations;
+        }
+
+        return ::operator new(class_bytes(cls));
+    }
+
+    void release(void *block, size_t cls) {
+        Guard G(lock_);
+        classes_[cls].free.push_back(block);
+        stats_.cached_bytes += class_bytes(cls);
+    }
+
+    void next_generation() {
+        std::vector<void*> unused;
+
+        {
+            Guard G(lock_);
+
+            for (size_t cls = 0; cls < classes_.size(); ++cls) {
+                auto & sc = classes_[cls];
+
+                // Keep as many blocks as were needed lately
+                size_t keep = std::max(sc.used, sc.used_before);
+
+                while (sc.free.size() > keep) {
+                    unused.push_back(sc.free.back());
+                    sc.free.pop_back();
+                    stats_.cached_bytes -= class_bytes(cls);
+                }
+
+                sc.used_before = sc.used;
+                sc.used = 0;
+            }
+        }
+
+        for (auto block : unused)
+            ::operator delete(block);
+    }
+
+    void count_unpooled() {
+        Guard G(lock_);
+        ++stats_.unpooled;
+    }
+
+    Stats stats() const {
+        Guard G(lock_);
+        return stats_;
+    }
+};
+
+ColumnArena::ColumnArena()
+: pool_(std::make_shared<Pool>())
+{}
+
+template<typename T>
+pvxs::shared_array<T> ColumnArena::allocate(size_t count) {
+    static_assert(std::is_pod<T>::value, "Only plain old data can be pooled");
+
+    size_t bytes = std::max<size_t>(count, 1) * sizeof(T);
+    size_t cls = Pool::class_of(bytes);
+
+    if (cls >= SIZE_CLASSES) {
+        pool_->count_unpooled();
+        return pvxs::shared_array<T>(count);
+    }
+
+    T *data = static_cast<T*>(pool_->acquire(cls));
+    std::shared_ptr<T> owner(data, Pool::Return{pool_, cls});
+    return pvxs::shared_array<T>(owner, data, count);
+}
+
+pvxs::shared_array<void> ColumnArena::allocate(pvxs::ArrayType type, size_t count) {
+    switch (type) {
+        #define CASE_ALLOCATE(AT, T)\
+            case pvxs::ArrayType::AT: return allocate<T>(count).castTo<void>()
+
+        CASE_ALLOCATE(Bool,    bool);
+        CASE_ALLOCATE(Int8,    int8_t);
+        CASE_ALLOCATE(Int16,   int16_t);
+        CASE_ALLOCATE(Int32,   int32_t);
+        CASE_ALLOCATE(Int64,   int64_t);
+        CASE_ALLOCATE(UInt8,   uint8_t);
+        CASE_ALLOCATE(UInt16,  uint16_t);
+        CASE_ALLOCATE(UInt32,  uint32_t);
+        CASE_ALLOCATE(UInt64,  uint64_t);
+        CASE_ALLOCATE(Float32, float);
+        CASE_ALLOCATE(Float64, double);
+
+        #undef CASE_ALLOCATE
+
+        default:
+            pool_->count_unpooled();
+            return pvxs::allocArray(type, count);
+    }
+}
+
+void ColumnArena::next_generation() {
+    pool_->next_generation();
+}
+
+ColumnArena::Stats ColumnArena::stats() const {
+    return pool_->stats();
+}
+
+// Used by callers with a static element type
+template pvxs::shared_array<bool> ColumnArena::allocate<bool>(size_t);
+template pvxs::shared_array<uint32_t> ColumnArena::allocate<uint32_t>(size_t);
+template pvxs::shared_array<uint64_t> ColumnArena::allocate<uint64_t>(size_t);
+
+}
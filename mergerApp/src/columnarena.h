@@ -0,0 +1,63 @@
+#ifndef TAB_COLUMNARENA_H
+#define TAB_COLUMNARENA_H
+
+#include <memory>
+#include <vector>
+
+#include <epicsMutex.h>
+
+#include <pvxs/data.h>
+
+namespace tabulator {
+
+/* ColumnArena
+ *
+ * Recycles the storage of output columns. Arrays allocated here give their
+ * memory back to the arena, instead of freeing it, once the last reference
+ * to them goes away (i.e. when pvxs is done with a posted value). Storage is
+ * kept in power of two size classes, so that columns of slightly different
+ * lengths can reuse each other's storage.
+ *
+ * Only plain old data elements are pooled. Other element types (i.e. strings)
+ * are allocated with `pvxs::allocArray` as usual.
+ *
+ * Memory not asked for during a whole generation (see `next_generation`) is
+ * released, so the arena doesn't hold on to size classes that fell out of use.
+ *
+ * Safe to use from multiple threads. Arrays may outlive the arena.
+ */
+class ColumnArena {
+
+public:
+    struct Stats {
+        size_t allocations;     // Pooled arrays that needed new memory
+        size_t reuses;          // Pooled arrays that reused memory
+        size_t unpooled;        // Arrays of elements that can't be pooled
+        size_t cached_bytes;    // Memory currently held for reuse
+    };
+
+private:
+    class Pool;
+    std::shared_ptr<Pool> pool_;
+
+public:
+    ColumnArena();
+
+    /* Allocates an array of `count` elements of type T, which must be plain old data */
+    template<typename T>
+    pvxs::shared_array<T> allocate(size_t count);
+
+    /* Allocates an array of `count` elements of the given type */
+    pvxs::shared_array<void> allocate(pvxs::ArrayType type, size_t count);
+
+    /* Starts a new generation. Releases memory that sat unused for the whole
+     * previous one.
+     */
+    void next_generation();
+
+    Stats stats() const;
+};
+
+}
+
+#endif
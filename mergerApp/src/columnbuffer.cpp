@@ -0,0 +1,140 @@
+#include "columnbuffer.h"
+
+#include <string>
+#include <vector>
+#include <iterator>
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+
+namespace tabulator {
+
+// T is the element type, S the type it is stored as. They only differ for
+// bool, since std::vector<bool> doesn't store its elements contiguously.
+template<typename T, typename S = T>
+class TypedColumnBuffer : public ColumnBuffer {
+private:
+    typedef std::integral_constant<bool, std::is_pod<S>::value> is_pod;
+
+    const pvxs::ArrayType type_;
+    const size_t initial_capacity_;
+    std::vector<S> storage_;
+    size_t head_;   // Index of the oldest buffered row in storage_
+    size_t bytes_;  // Bytes held by the buffered rows
+
+    void compact() {
+        storage_.erase(storage_.begin(), storage_.begin() + head_);
+        head_ = 0;
+
+        // Give back memory left over from a burst
+        if (storage_.capacity() > initial_capacity_ && storage_.capacity() > 4*storage_.size()) {
+            std::vector<S> shrunk;
+            shrunk.reserve(std::max(initial_capacity_, 2*storage_.size()));
+            shrunk.insert(shrunk.end(), std::make_move_iterator(storage_.begin()), std::make_move_iterator(storage_.end()));
+            storage_.swap(shrunk);
+        }
+    }
+
+    static size_t count_bytes(const S *, size_t n, std::true_type) {
+        return n * sizeof(S);
+    }
+
+    static size_t count_bytes(const S *elems, size_t n, std::false_type) {
+        size_t total = 0;
+        for (size_t i = 0; i < n; ++i)
+            total += sizeof(S) + elems[i].capacity();
+        return total;
+    }
+
+    // Nothing to free for plain old data
+    void release(size_t, std::true_type) {}
+
+    // Free memory held by the consumed elements (i.e. strings) right away
+    void release(size_t n, std::false_type) {
+        for (auto it = storage_.begin() + head_; it != storage_.begin() + head_ + n; ++it)
+            S().swap(*it);
+    }
+
+public:
+    TypedColumnBuffer(pvxs::ArrayType type, size_t capacity)
+    : type_(type), initial_capacity_(capacity), storage_(), head_(0), bytes_(0)
+    {
+        storage_.reserve(capacity);
+    }
+
+    virtual pvxs::ArrayType type() const {
+        return type_;
+    }
+
+    virtual size_t size() const {
+        return storage_.size() - head_;
+    }
+
+    virtual size_t capacity() const {
+        return storage_.capacity();
+    }
+
+    virtual size_t bytes() const {
+        return bytes_;
+    }
+
+    virtual const void * data() const {
+        return storage_.data() + head_;
+    }
+
+    virtual void append(const pvxs::shared_array<const void> & values) {
+        if (values.original_type() != type_)
+            throw std::logic_error("Can't append values of a different type to a column");
+
+        // Reuse consumed space instead of growing, if that is enough
+        if (head_ > 0 && storage_.size() + values.size() > storage_.capacity())
+            compact();
+
+        const T *begin = static_cast<const T*>(values.data());
+        storage_.insert(storage_.end(), begin, begin + values.size());
+        bytes_ += count_bytes(storage_.data() + storage_.size() - values.size(), values.size(), is_pod());
+    }
+
+    virtual void consume(size_t n) {
+        n = std::min(n, size());
+        bytes_ -= count_bytes(storage_.data() + head_, n, is_pod());
+        release(n, is_pod());
+        head_ += n;
+
+        if (head_ == storage_.size()) {
+            storage_.clear();
+            head_ = 0;
+        } else if (head_ >= storage_.size() / 2) {
+            compact();
+        }
+    }
+};
+
+std::unique_ptr<ColumnBuffer> ColumnBuffer::create(pvxs::ArrayType type, size_t capacity) {
+    static_assert(sizeof(bool) == sizeof(uint8_t), "bool columns are stored as uint8_t");
+
+    switch (type) {
+        #define CASE_CREATE(AT, ...)\
+            case pvxs::ArrayType::AT: return std::unique_ptr<ColumnBuffer>(new TypedColumnBuffer<__VA_ARGS__>(type, capacity))
+
+        CASE_CREATE(Bool,    bool, uint8_t);
+        CASE_CREATE(Int8,    int8_t);
+        CASE_CREATE(Int16,   int16_t);
+        CASE_CREATE(Int32,   int32_t);
+        CASE_CREATE(Int64,   int64_t);
+        CASE_CREATE(UInt8,   uint8_t);
+        CASE_CREATE(UInt16,  uint16_t);
+        CASE_CREATE(UInt32,  uint32_t);
+        CASE_CREATE(UInt64,  uint64_t);
+        CASE_CREATE(Float32, float);
+        CASE_CREATE(Float64, double);
+        CASE_CREATE(String,  std::string);
+
+        #undef CASE_CREATE
+
+        default:
+            throw std::runtime_error("Don't know how to buffer this element type");
+    }
+}
+
+}
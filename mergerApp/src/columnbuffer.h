@@ -0,0 +1,52 @@
+#ifndef TAB_COLUMNBUFFER_H
+#define TAB_COLUMNBUFFER_H
+
+#include <memory>
+
+#include <pvxs/data.h>
+
+namespace tabulator {
+
+/* ColumnBuffer
+ *
+ * Contiguous, typed storage for the rows of a single column. Rows are
+ * appended at the back and consumed from the front. The space taken by
+ * consumed rows is reclaimed by compaction (moving the remaining rows to
+ * the front of the storage) once it makes up at least half of it, so the
+ * buffered rows are always a single contiguous range that can be read
+ * with plain pointer arithmetic.
+ */
+class ColumnBuffer {
+public:
+    /* Creates a buffer for elements of the given type, with room
+     * for `capacity` rows before it needs to grow
+     */
+    static std::unique_ptr<ColumnBuffer> create(pvxs::ArrayType type, size_t capacity);
+
+    virtual ~ColumnBuffer() {}
+
+    /* Element type */
+    virtual pvxs::ArrayType type() const = 0;
+
+    /* Number of buffered rows */
+    virtual size_t size() const = 0;
+
+    /* Number of rows that fit in the current storage */
+    virtual size_t capacity() const = 0;
+
+    /* Approximate number of bytes held by the buffered rows */
+    virtual size_t bytes() const = 0;
+
+    /* Pointer to the oldest buffered row. Invalidated by `append` and `consume` */
+    virtual const void * data() const = 0;
+
+    /* Appends all elements of `values`, which must be of type `type()` */
+    virtual void append(const pvxs::shared_array<const void> & values) = 0;
+
+    /* Drops the `n` oldest rows */
+    virtual void consume(size_t n) = 0;
+};
+
+}
+
+#endif
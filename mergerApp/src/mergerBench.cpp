@@ -0,0 +1,459 @@
+#include <string>
+#include <iostream>
+#include <vector>
+#include <set>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+#include <stdexcept>
+#include <new>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+
+#include <epicsTime.h>
+#include <epicsStdio.h>
+
+#include <pvxs/log.h>
+
+#include <clipp.h>
+
+#include <tab/nttable.h>
+#include <tab/timetable.h>
+
+#include "tablebuffer.h"
+#include "taligntable.h"
+
+DEFINE_LOGGER(LOG, "merger.bench");
+
+using tabulator::nt::NTTable;
+using tabulator::TimeTable;
+using tabulator::TimeStamp;
+using tabulator::TimeSpan;
+using tabulator::TimeBounds;
+using tabulator::TableBuffer;
+using tabulator::TimeAlignedTable;
+
+// Every allocation made through operator new, by this program or the libraries it links
+static std::atomic<size_t> allocations(0);
+
+void * operator new(size_t size) {
+    ++allocations;
+
+    void *p = std::malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+// Rows of simulated inputs are 1 ms apart, starting here
+static const epicsUInt32 BASE_SECONDS = 1000000000u;
+static const size_t ROWS_PER_SECOND = 1000u;
+
+// Staggered inputs are split in this many groups, each one a few ns late
+static const size_t STAGGER_GROUPS = 8u;
+
+// Repeated inputs send each timestamp this many times in a row within an update
+static const size_t REPEAT_RUN = 3u;
+
+struct Params {
+    size_t inputs;
+    size_t rows_per_update;
+    size_t updates;
+    size_t columns;
+    std::string type;
+    std::string pattern;
+};
+
+struct Result {
+    size_t rows;
+    epicsUInt64 ns;
+    size_t allocations;
+};
+
+static pvxs::TypeCode type_code(const std::string & type) {
+    if (type == "float64") return pvxs::TypeCode::Float64A;
+    if (type == "int32")   return pvxs::TypeCode::Int32A;
+    if (type == "uint8")   return pvxs::TypeCode::UInt8A;
+    if (type == "string")  return pvxs::TypeCode::StringA;
+    throw std::invalid_argument("Invalid column type: " + type);
+}
+
+// Whether input `input` has a row at global row index `row`
+static bool has_row(const Params & params, size_t input, size_t row) {
+    if (params.pattern == "mixed-rate")
+        return row % (input % 4 + 1) == 0;  // Full, 1/2, 1/3 and 1/4 rate inputs
+
+    return true;
+}
+
+// Global row index whose timestamp (and pulse id) row `row` carries. Repeated
+// timestamps come in runs of REPEAT_RUN rows, each run inside a single update.
+static size_t timestamp_row(const Params & params, size_t row) {
+    if (params.pattern == "repeated")
+        return row - row % params.rows_per_update % REPEAT_RUN;
+
+    return row;
+}
+
+// Pulse id of global row index `row`. Out of order pulse ids go backwards every
+// other row and repeat an earlier one every 8 rows, while timestamps keep rising.
+static TimeTable::PULSE_ID_T pulse_id(const Params & params, size_t row) {
+    if (params.pattern == "out-of-order")
+        return row % 8 == 7 ? row - 2 : row ^ 1;
+
+    return row;
+}
+
+// Updates of every input, built once and pushed by every benchmark
+class Inputs {
+public:
+    const Params params;
+    const TimeTable type;
+    std::vector<std::string> pvlist;
+    std::vector<std::vector<pvxs::Value>> updates;  // By input, then by update
+    size_t rows;
+
+    Inputs(const Params & params)
+    : params(params), type(data_columns(params)), pvlist(), updates(params.inputs), rows(0)
+    {
+        char pvname[64];
+
+        for (size_t i = 0; i < params.inputs; ++i) {
+            epicsSnprintf(pvname, sizeof(pvname), "BENCH:INPUT:%04lu", i);
+            pvlist.push_back(pvname);
+
+            for (size_t u = 0; u < params.updates; ++u)
+                updates[i].push_back(build(i, u));
+        }
+    }
+
+private:
+    static std::vector<NTTable::ColumnSpec> data_columns(const Params & params) {
+        std::vector<NTTable::ColumnSpec> columns;
+
+        for (size_t c = 0; c < params.columns; ++c)
+            columns.emplace_back(type_code(params.type), "value" + std::to_string(c), "Value " + std::to_string(c));
+
+        return columns;
+    }
+
+    pvxs::Value build(size_t input, size_t update) {
+        std::vector<TimeTable::SECONDS_PAST_EPOCH_T> seconds;
+        std::vector<TimeTable::NANOSECONDS_T> nanoseconds;
+        std::vector<TimeTable::PULSE_ID_T> pulse_ids;
+
+        epicsUInt32 stagger = params.pattern == "staggered" ? input % STAGGER_GROUPS : 0;
+
+        for (size_t r = 0; r < params.rows_per_update; ++r) {
+            size_t row = update * params.rows_per_update + r;
+
+            if (!has_row(params, input, row))
+                continue;
+
+            size_t ts_row = timestamp_row(params, row);
+            seconds.push_back(BASE_SECONDS + ts_row / ROWS_PER_SECOND);
+            nanoseconds.push_back((ts_row % ROWS_PER_SECOND) * (1000000000u / ROWS_PER_SECOND) + stagger);
+            pulse_ids.push_back(pulse_id(params, ts_row));
+        }
+
+        size_t num_rows = seconds.size();
+        rows += num_rows;
+
+        auto value = type.create();
+        value.set_column(TimeTable::SECONDS_PAST_EPOCH_COL, seconds.begin(), seconds.end());
+        value.set_column(TimeTable::NANOSECONDS_COL, nanoseconds.begin(), nanoseconds.end());
+        value.set_column(TimeTable::PULSE_ID_COL, pulse_ids.begin(), pulse_ids.end());
+
+        auto columns = value.get()[NTTable::COLUMNS_FIELD];
+
+        for (const auto & spec : type.data_columns) {
+            auto array_type = spec.type_code.arrayType();
+            auto contents = pvxs::allocArray(array_type, num_rows);
+
+            if (array_type != pvxs::ArrayType::String)
+                std::memset(contents.data(), 0, num_rows * pvxs::elementSize(array_type));
+
+            columns[spec.name] = contents.freeze();
+        }
+
+        return value.get();
+    }
+};
+
+// Times one run of `f`, which processes `rows` rows
+static Result measure(size_t rows, std::function<void()> f) {
+    size_t allocations_before = allocations;
+    epicsUInt64 start = epicsMonotonicGet();
+
+    f();
+
+    epicsUInt64 end = epicsMonotonicGet();
+    return Result{ rows, end - start, allocations - allocations_before };
+}
+
+// One buffer per input, with all of its updates pushed (and collected, if asked)
+static std::vector<std::unique_ptr<TableBuffer>> fill_buffers(const Inputs & inputs, bool collect) {
+    std::vector<std::unique_ptr<TableBuffer>> buffers;
+    bool watch_reached;
+
+    for (size_t i = 0; i < inputs.params.inputs; ++i) {
+        buffers.emplace_back(new TableBuffer());
+
+        for (const auto & update : inputs.updates[i])
+            buffers.back()->push(update, watch_reached);
+
+        if (collect)
+            buffers.back()->collect();
+    }
+
+    return buffers;
+}
+
+static Result bench_push(const Inputs & inputs) {
+    std::vector<std::unique_ptr<TableBuffer>> buffers;
+
+    for (size_t i = 0; i < inputs.params.inputs; ++i)
+        buffers.emplace_back(new TableBuffer());
+
+    return measure(inputs.rows, [&]() {
+        bool watch_reached;
+
+        for (size_t u = 0; u < inputs.params.updates; ++u) {
+            for (size_t i = 0; i < inputs.params.inputs; ++i)
+                buffers[i]->push(inputs.updates[i][u], watch_reached);
+        }
+    });
+}
+
+static Result bench_collect(const Inputs & inputs) {
+    auto buffers = fill_buffers(inputs, false);
+
+    return measure(inputs.rows, [&]() {
+        for (auto & buffer : buffers)
+            buffer->collect();
+    });
+}
+
+static Result bench_consume_each_row(const Inputs & inputs) {
+    auto buffers = fill_buffers(inputs, true);
+    size_t consumed = 0;
+
+    auto result = measure(inputs.rows, [&]() {
+        for (auto & buffer : buffers) {
+            buffer->consume_each_row([&consumed](const TimeStamp &, const std::vector<const void *> &, size_t) {
+                ++consumed;
+                return false;
+            });
+        }
+    });
+
+    if (consumed != inputs.rows)
+        log_warn_printf(LOG, "consume_each_row: consumed %lu rows, expected %lu\n", consumed, inputs.rows);
+
+    return result;
+}
+
+static Result bench_extract_timestamps_between(const Inputs & inputs) {
+    auto buffers = fill_buffers(inputs, true);
+    std::set<TimeStamp> timestamps;
+
+    return measure(inputs.rows, [&]() {
+        for (auto & buffer : buffers)
+            buffer->extract_timestamps_between(TimeSpan::MIN_TS, TimeSpan::MAX_TS, timestamps);
+    });
+}
+
+static Result bench_extract(const Inputs & inputs, size_t extract_threads, TimeAlignedTable::Alignment alignment) {
+    TimeAlignedTable table(inputs.pvlist, ".", "_", extract_threads, alignment);
+
+    for (size_t u = 0; u < inputs.params.updates; ++u) {
+        for (size_t i = 0; i < inputs.params.inputs; ++i)
+            table.push(inputs.pvlist[i], inputs.updates[i][u]);
+    }
+
+    if (!table.initialized())
+        throw std::logic_error("Table should be initialized by this point");
+
+    TimeBounds bounds = table.get_timebounds();
+    TimeStamp end = bounds.latest_end;
+    ++end.utag;
+
+    return measure(inputs.rows, [&]() {
+        table.extract(bounds.earliest_start, end);
+    });
+}
+
+static Result bench_is_valid(const Inputs & inputs) {
+    size_t invalid = 0;
+
+    auto result = measure(inputs.rows, [&]() {
+        for (const auto & input_updates : inputs.updates) {
+            for (const auto & update : input_updates) {
+                if (!inputs.type.is_valid(update))
+                    ++invalid;
+            }
+        }
+    });
+
+    if (invalid > 0)
+        log_warn_printf(LOG, "is_valid: %lu invalid updates\n", invalid);
+
+    return result;
+}
+
+int main (int argc, char *argv[]) {
+    std::vector<std::string> benchmarks;
+    std::vector<size_t> input_counts;
+    std::vector<size_t> rows_per_update;
+    std::vector<std::string> types;
+    std::vector<std::string> patterns;
+    size_t updates = 10;
+    size_t columns = 1;
+    size_t extract_threads = 1;
+    size_t repeat = 5;
+
+    const std::vector<std::string> ALL_BENCHMARKS {
+        "push", "collect", "consume_each_row", "extract_timestamps_between", "extract", "extract_pulse_id", "is_valid"
+    };
+
+    pvxs::logger_config_env();
+
+    auto cli = (
+        clipp::option("--benchmark")
+            .doc("Benchmarks to run: 'push', 'collect', 'consume_each_row', 'extract_timestamps_between' (TableBuffer), 'extract', 'extract_pulse_id' (TimeAlignedTable, aligning by timestamp or pulse id) and 'is_valid' (TimeTable). Default: all.")
+            & clipp::values("benchmark", benchmarks),
+
+        clipp::option("--inputs")
+            .doc("Numbers of input PVs. Default: 16 256 1024 4096.")
+            & clipp::values("inputs", input_counts),
+
+        clipp::option("--rows-per-update")
+            .doc("Numbers of rows in each update. Default: 10.")
+            & clipp::values("rows_per_update", rows_per_update),
+
+        clipp::option("--updates")
+            .doc("Number of updates of each input PV. Default: 10.")
+            & clipp::value("updates", updates),
+
+        clipp::option("--columns")
+            .doc("Number of data columns of each input PV. Default: 1.")
+            & clipp::value("columns", columns),
+
+        clipp::option("--type")
+            .doc("Types of the data columns: 'float64', 'int32', 'uint8' or 'string'. Default: float64.")
+            & clipp::values("type", types),
+
+        clipp::option("--pattern")
+            .doc("How the rows of the input PVs line up: 'aligned' (same timestamps), 'staggered' (a few ns apart, in 8 groups), 'mixed-rate' (full, 1/2, 1/3 and 1/4 rate inputs), 'out-of-order' (aligned, but pulse ids go backwards and repeat) or 'repeated' (aligned, but each timestamp comes in a run of 3 rows). Default: all.")
+            & clipp::values("pattern", patterns),
+
+        clipp::option("--extract-threads")
+            .doc("Number of threads building the columns of each merged table. Default: 1.")
+            & clipp::value("extract_threads", extract_threads),
+
+        clipp::option("--repeat")
+            .doc("Number of runs of each benchmark. The fastest one is reported. Default: 5.")
+            & clipp::value("repeat", repeat)
+    );
+
+    auto man_page = clipp::make_man_page(cli, argv[0]);
+
+    if (!clipp::parse(argc, argv, cli)) {
+        std::cerr << man_page;
+        return 1;
+    }
+
+    if (benchmarks.empty())
+        benchmarks = ALL_BENCHMARKS;
+
+    if (input_counts.empty())
+        input_counts = { 16, 256, 1024, 4096 };
+
+    if (rows_per_update.empty())
+        rows_per_update = { 10 };
+
+    if (types.empty())
+        types = { "float64" };
+
+    if (patterns.empty())
+        patterns = { "aligned", "staggered", "mixed-rate", "out-of-order", "repeated" };
+
+    // Validate arguments
+    #define VALIDATE_ARG(COND, FMT, ARG)\
+        do {\
+            if (COND) {\
+                log_err_printf(LOG, FMT, ARG);\
+                std::cerr << man_page;\
+                return 1;\
+            }\
+        } while(0)
+
+    for (const auto & benchmark : benchmarks)
+        VALIDATE_ARG(std::find(ALL_BENCHMARKS.begin(), ALL_BENCHMARKS.end(), benchmark) == ALL_BENCHMARKS.end(), "Invalid benchmark: %s\n", benchmark.c_str());
+    for (auto n : input_counts)
+        VALIDATE_ARG(n == 0, "Invalid number of inputs: %lu\n", n);
+    for (auto n : rows_per_update)
+        VALIDATE_ARG(n == 0, "Invalid number of rows per update: %lu\n", n);
+    for (const auto & type : types)
+        VALIDATE_ARG(type != "float64" && type != "int32" && type != "uint8" && type != "string", "Invalid column type: %s\n", type.c_str());
+    for (const auto & pattern : patterns)
+        VALIDATE_ARG(pattern != "aligned" && pattern != "staggered" && pattern != "mixed-rate" && pattern != "out-of-order" && pattern != "repeated", "Invalid pattern: %s\n", pattern.c_str());
+    VALIDATE_ARG(updates == 0, "Invalid number of updates: %lu\n", updates);
+    VALIDATE_ARG(columns == 0, "Invalid number of columns: %lu\n", columns);
+    VALIDATE_ARG(extract_threads == 0, "Invalid number of extract threads: %lu\n", extract_threads);
+    VALIDATE_ARG(repeat == 0, "Invalid number of runs: %lu\n", repeat);
+    #undef VALIDATE_ARG
+
+    printf("%-28s %7s %9s %8s %11s %10s %12s %12s\n",
+        "benchmark", "inputs", "rows/upd", "type", "pattern", "rows", "ns/row", "allocs/row");
+
+    for (auto num_inputs : input_counts) {
+        for (auto num_rows : rows_per_update) {
+            for (const auto & type : types) {
+                for (const auto & pattern : patterns) {
+                    Inputs inputs(Params{ num_inputs, num_rows, updates, columns, type, pattern });
+
+                    for (const auto & benchmark : benchmarks) {
+                        Result best = Result();
+
+                        for (size_t run = 0; run < repeat; ++run) {
+                            Result result;
+
+                            if (benchmark == "push")
+                                result = bench_push(inputs);
+                            else if (benchmark == "collect")
+                                result = bench_collect(inputs);
+                            else if (benchmark == "consume_each_row")
+                                result = bench_consume_each_row(inputs);
+                            else if (benchmark == "extract_timestamps_between")
+                                result = bench_extract_timestamps_between(inputs);
+                            else if (benchmark == "extract")
+                                result = bench_extract(inputs, extract_threads, TimeAlignedTable::Alignment::TIMESTAMP);
+                            else if (benchmark == "extract_pulse_id")
+                                result = bench_extract(inputs, extract_threads, TimeAlignedTable::Alignment::PULSE_ID);
+                            else
+                                result = bench_is_valid(inputs);
+
+                            if (run == 0 || result.ns < best.ns)
+                                best = result;
+                        }
+
+                        printf("%-28s %7lu %9lu %8s %11s %10lu %12.1f %12.3f\n",
+                            benchmark.c_str(), num_inputs, num_rows, type.c_str(), pattern.c_str(), best.rows,
+                            best.rows > 0 ? double(best.ns) / best.rows : 0.0,
+                            best.rows > 0 ? double(best.allocations) / best.rows : 0.0);
+                        fflush(stdout);
+                    }
+                }
+            }
+        }
+    }
+
+    return 0;
+}
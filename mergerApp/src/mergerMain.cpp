@@ -2,7 +2,12 @@
 #include <iostream>
 #include <fstream>
 #include <deque>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <functional>
 #include <utility>
+#include <csignal>
 
 #include <epicsEvent.h>
 #include <epicsMutex.h>
@@ -22,10 +27,13 @@
 #include <iostream>
 
 #include "taligntable.h"
+#include "metrics.h"
+#include "recording.h"
 
 DEFINE_LOGGER(LOG, "merger");
 DEFINE_LOGGER(LISTENER_LOG, "merger.listener");
 DEFINE_LOGGER(REACTOR_LOG, "merger.reactor");
+DEFINE_LOGGER(REPLAYER_LOG, "merger.replayer");
 DEFINE_LOGGER(SERVER_LOG, "merger.server");
 
 using tabulator::nt::NTTable;
@@ -33,9 +41,27 @@ using tabulator::TimeSpan;
 using tabulator::TimeStamp;
 using tabulator::TimeBounds;
 using tabulator::TimeAlignedTable;
+using tabulator::MergerMetrics;
+using tabulator::Recorder;
+using tabulator::Recording;
+
+typedef epicsGuard<epicsMutex> Guard;
 
 static const size_t QUEUE_SIZE = 1024u;
 
+// How often the latency added by the merger is reported, in seconds
+static const double LATENCY_REPORT_PERIOD = 60.0;
+
+// Metrics are published once per period, but no more often than this, in seconds
+static const double METRICS_MIN_PERIOD = 1.0;
+
+// Set on SIGHUP: the input PV list is to be read again
+static volatile sig_atomic_t reload_requested = 0;
+
+static void request_reload(int) {
+    reload_requested = 1;
+}
+
 class Runnable : public epicsThreadRunable {
 protected:
     std::shared_ptr<pvxs::MPMCFIFO<Runnable*>> dead_;
@@ -74,37 +100,67 @@ class Listener : public Runnable {
 private:
     pvxs::client::Context client_;
     pvxs::MPMCFIFO<std::pair<size_t, std::shared_ptr<pvxs::client::Subscription>>> queue_;
-    std::vector<std::shared_ptr<pvxs::client::Subscription>> subscriptions_;
+    mutable epicsMutex lock_;
+    std::map<std::string, std::shared_ptr<pvxs::client::Subscription>> subscriptions_;
+    size_t next_col_idx_;
     std::shared_ptr<TimeAlignedTable> taligned_table_;
+    std::shared_ptr<Recorder> recorder_;
 
 public:
     Listener(
-        std::shared_ptr<pvxs::MPMCFIFO<Runnable*>> dead, const std::vector<std::string> & pvlist,
-        const std::shared_ptr<TimeAlignedTable> & taligned_table
+        std::shared_ptr<pvxs::MPMCFIFO<Runnable*>> dead, pvxs::client::Context & client,
+        const std::vector<std::string> & pvlist, const std::shared_ptr<TimeAlignedTable> & taligned_table,
+        const std::shared_ptr<Recorder> & recorder
     ) : Runnable(typeid(Listener).name(), dead),
-      client_(pvxs::client::Context::fromEnv()), queue_(QUEUE_SIZE),
-      subscriptions_(), taligned_table_(taligned_table)
+      client_(client), queue_(QUEUE_SIZE), lock_(),
+      subscriptions_(), next_col_idx_(0), taligned_table_(taligned_table), recorder_(recorder)
     {
         // Create subscriptions
-        size_t col_idx = 0;
-        for (auto pvname : pvlist) {
-            subscriptions_.emplace_back(
-                client_
-                    .monitor(pvname)
-                    .maskConnected(false)
-                    .maskDisconnected(false)
-                    .event([this, col_idx](pvxs::client::Subscription &sub) {
-                        this->queue_.push(std::make_pair(col_idx, sub.shared_from_this()));
-                    })
-                    .exec());
-
-            ++col_idx;
-        }
+        for (auto pvname : pvlist)
+            subscribe(pvname);
+    }
+
+    // Starts (or restarts) a subscription. Safe to call while running.
+    void subscribe(const std::string & pvname) {
+        Guard G(lock_);
+
+        auto existing = subscriptions_.find(pvname);
+        if (existing != subscriptions_.end())
+            existing->second->cancel();
+
+        size_t col_idx = next_col_idx_++;
+
+        subscriptions_[pvname] =
+            client_
+                .monitor(pvname)
+                .maskConnected(false)
+                .maskDisconnected(false)
+                .event([this, col_idx](pvxs::client::Subscription &sub) {
+                    this->queue_.push(std::make_pair(col_idx, sub.shared_from_this()));
+                })
+                .exec();
+    }
+
+    // Cancels a subscription, if there is one. Safe to call while running.
+    void unsubscribe(const std::string & pvname) {
+        Guard G(lock_);
+
+        auto existing = subscriptions_.find(pvname);
+        if (existing == subscriptions_.end())
+            return;
+
+        existing->second->cancel();
+        subscriptions_.erase(existing);
+    }
+
+    size_t num_subscriptions() const {
+        Guard G(lock_);
+        return subscriptions_.size();
     }
 
     void run() {
         log_info_printf(LISTENER_LOG, "Starting%s\n", "");
-        log_info_printf(LISTENER_LOG, "  # subscriptions=%lu\n", subscriptions_.size());
+        log_info_printf(LISTENER_LOG, "  # subscriptions=%lu\n", num_subscriptions());
 
         while (running_) {
             auto item = queue_.pop();
@@ -124,12 +180,20 @@ public:
                 if (!value)
                     continue;
 
+                if (recorder_)
+                    recorder_->write(sub->name(), value);
+
                 //std::cout << sub->name() << std::endl << update.get();
                 taligned_table_->push(sub->name(), value);
 
             } catch (std::out_of_range & ex) {
                 log_warn_printf(LISTENER_LOG, "Can't push new data for '%s', cancelling sub\n", sub->name().c_str());
                 sub->cancel();
+            } catch (std::invalid_argument & ex) {
+                log_err_printf(LISTENER_LOG, "Can't merge '%s', dropping it and cancelling sub: %s\n",
+                    sub->name().c_str(), ex.what());
+                sub->cancel();
+                continue;
             } catch (pvxs::client::Connected & ex) {
                 log_info_printf(LISTENER_LOG, "PV connected: %s\n", sub->name().c_str());
             } catch (pvxs::client::Disconnect & ex) {
@@ -155,23 +219,295 @@ public:
     virtual ~Listener() {}
 };
 
+// Feeds the table with the updates of a recording instead of live subscriptions
+class Replayer : public Runnable {
+private:
+    std::unique_ptr<Recording> recording_;
+    std::shared_ptr<TimeAlignedTable> taligned_table_;
+    double speed_;
+    double drain_;
+
+public:
+    // speed: relative to the recorded pace, or 0 to replay as fast as possible.
+    // drain: how long to wait, once the recording is over, for buffered rows to be published.
+    Replayer(
+        std::shared_ptr<pvxs::MPMCFIFO<Runnable*>> dead, std::unique_ptr<Recording> recording,
+        const std::shared_ptr<TimeAlignedTable> & taligned_table, double speed, double drain
+    ) : Runnable(typeid(Replayer).name(), dead),
+      recording_(std::move(recording)), taligned_table_(taligned_table), speed_(speed), drain_(drain)
+    {}
+
+    void run() {
+        log_info_printf(REPLAYER_LOG, "Starting%s\n", "");
+        log_info_printf(REPLAYER_LOG, "  speed=%.3f%s\n", speed_, speed_ == 0 ? " (as fast as possible)" : "");
+
+        Recording::Update update;
+        std::set<std::string> unknown;
+        size_t updates = 0, rows = 0;
+
+        epicsTimeStamp first_received = epicsTimeStamp();
+        epicsTimeStamp start, now;
+        epicsTimeGetCurrent(&start);
+
+        try {
+            while (running_ && recording_->next(update)) {
+                if (updates == 0)
+                    first_received = update.received;
+
+                // Keep the recorded gaps between updates, scaled
+                if (speed_ > 0) {
+                    epicsTimeGetCurrent(&now);
+                    double ahead = epicsTimeDiffInSeconds(&update.received, &first_received) / speed_
+                        - epicsTimeDiffInSeconds(&now, &start);
+
+                    if (ahead > 0)
+                        epicsThreadSleep(ahead);
+                }
+
+                try {
+                    taligned_table_->push(update.pvname, update.value);
+                } catch (std::out_of_range & ex) {
+                    if (unknown.insert(update.pvname).second)
+                        log_warn_printf(REPLAYER_LOG, "Skipping updates of '%s', not an input PV\n", update.pvname.c_str());
+                    continue;
+                } catch (std::invalid_argument & ex) {
+                    unknown.insert(update.pvname);
+                    log_err_printf(REPLAYER_LOG, "Can't merge '%s', skipping its updates: %s\n",
+                        update.pvname.c_str(), ex.what());
+                    continue;
+                }
+
+                ++updates;
+                rows += update.value[NTTable::COLUMNS_FIELD][tabulator::TimeTable::SECONDS_PAST_EPOCH_COL]
+                    .as<pvxs::shared_array<const void>>().size();
+            }
+        } catch (std::exception & e) {
+            log_err_printf(REPLAYER_LOG, "Error: %s\n", e.what());
+        }
+
+        epicsTimeGetCurrent(&now);
+        double elapsed = epicsTimeDiffInSeconds(&now, &start);
+
+        log_info_printf(REPLAYER_LOG, "Replayed %lu updates (%lu rows) in %.3f s: %.1f updates/s, %.1f rows/s\n",
+            updates, rows, elapsed, elapsed > 0 ? updates / elapsed : 0.0, elapsed > 0 ? rows / elapsed : 0.0);
+
+        // Give the reactor a chance to publish what's left
+        epicsTimeStamp drain_start = now;
+
+        while (running_ && taligned_table_->get_timebounds().valid && epicsTimeDiffInSeconds(&now, &drain_start) < drain_) {
+            epicsThreadSleep(0.1);
+            epicsTimeGetCurrent(&now);
+        }
+
+        log_info_printf(REPLAYER_LOG, "Ending%s\n", "");
+        stopped();
+    }
+
+    virtual ~Replayer() {}
+};
+
+// Smallest timestamp after ts (saturates at TimeSpan::MAX_TS)
+static TimeStamp after(TimeStamp ts) {
+    if (ts == TimeSpan::MAX_TS)
+        return ts;
+
+    if (ts.utag < TimeSpan::MAX_U64) {
+        ++ts.utag;
+    } else {
+        ts.utag = 0;
+        epicsTimeAddSeconds(&ts.ts, 1e-9);
+    }
+
+    return ts;
+}
+
 class Reactor : public Runnable {
+public:
+    // When merged tables are published
+    enum class Mode {
+        WINDOW, // One period at a time, once all inputs cover it (or timeout expires)
+        STREAM, // As soon as rows are complete (or older than the allowed lateness)
+    };
+
+    // Reads the list of input PVs
+    typedef std::function<std::vector<std::string>()> LoadFunc;
+
+    // Subscribes to the added input PVs and unsubscribes from the removed ones
+    typedef std::function<void(const std::vector<std::string> & added,
+        const std::vector<std::string> & removed)> ResubscribeFunc;
+
 private:
     std::shared_ptr<TimeAlignedTable> taligned_table_;
     double period_;
     double timeout_;
+    Mode mode_;
+    double catchup_;
+    size_t max_rows_;
     pvxs::server::SharedPV pv_;
 
+    // End of the last extraction. In stream mode, rows arriving after
+    // their time was published are too late and get dropped.
+    TimeStamp emitted_end_;
+
+    // How to apply a new list of input PVs
+    LoadFunc load_pvlist_;
+    ResubscribeFunc resubscribe_;
+
+    // Where to publish metrics, if anywhere
+    MergerMetrics *metrics_;
+
+    // A reload is waiting for its added inputs to join the table, until settle_deadline_.
+    // The output type changed since it was last published.
+    bool settling_;
+    epicsTimeStamp settle_deadline_;
+    bool type_changed_;
+
+    // The output type changed: clients must reconnect to get the new one
+    void reopen() {
+        log_info_printf(REACTOR_LOG, "Merged table type changed, reopening output PV%s\n", "");
+        pv_.close();
+        pv_.open(taligned_table_->create());
+    }
+
+    // Applies changes to the list of input PVs, between two extractions.
+    // Unchanged inputs keep their subscriptions and buffered rows.
+    void reload() {
+        if (!load_pvlist_) {
+            log_warn_printf(REACTOR_LOG, "Can't reload the list of input PVs%s\n", "");
+            return;
+        }
+
+        std::vector<std::string> added, removed;
+        bool changed = taligned_table_->reconfigure(load_pvlist_(), added, removed);
+
+        log_info_printf(REACTOR_LOG, "Reloaded the list of input PVs: %lu added, %lu removed\n",
+            added.size(), removed.size());
+
+        if (resubscribe_)
+            resubscribe_(added, removed);
+
+        // The new type is published once the added inputs joined (see settle())
+        type_changed_ = type_changed_ || changed;
+        settling_ = true;
+        epicsTimeGetCurrent(&settle_deadline_);
+        epicsTimeAddSeconds(&settle_deadline_, std::max(timeout_, period_));
+    }
+
+    // Lets the inputs added by the last reload join the table. Extraction waits until
+    // all of them joined, or they had max(timeout, period) to get their first update,
+    // so the output type only changes once per reload. Inputs that didn't make it are
+    // dropped until the next reload. Returns false while waiting.
+    bool settle() {
+        if (taligned_table_->activate_inputs(emitted_end_))
+            type_changed_ = true;
+
+        if (settling_) {
+            epicsTimeStamp now;
+            epicsTimeGetCurrent(&now);
+
+            if (taligned_table_->num_pending_inputs() > 0 && epicsTimeDiffInSeconds(&settle_deadline_, &now) > 0)
+                return false;
+
+            std::vector<std::string> dropped;
+            taligned_table_->drop_pending_inputs(dropped);
+
+            if (!dropped.empty()) {
+                log_warn_printf(REACTOR_LOG, "%lu added input PVs got no update in time, ignored until the next reload\n",
+                    dropped.size());
+
+                if (resubscribe_)
+                    resubscribe_(std::vector<std::string>(), dropped);
+            }
+
+            settling_ = false;
+        }
+
+        if (type_changed_) {
+            reopen();
+            type_changed_ = false;
+        }
+
+        return true;
+    }
+
+    // Window mode: the next period, if all inputs have data for it, or some input
+    // is more than timeout_ ahead. Returns false if there's nothing to extract yet.
+    bool next_window(const TimeBounds & bounds, bool over_budget, TimeStamp & start, TimeStamp & end) {
+        if (!bounds.valid)
+            return false;
+
+        TimeSpan shortest(bounds.earliest_start, bounds.earliest_end);
+        TimeSpan longest(bounds.earliest_start, bounds.latest_end);
+
+        log_debug_printf(REACTOR_LOG, "Considering timespans shortest=%.6f s, longest=%.6f%s\n",
+            shortest.span_sec(), longest.span_sec(), over_budget ? " (over memory budget)" : "");
+
+        start = bounds.earliest_start;
+        end = start;
+        epicsTimeAddSeconds(&end.ts, period_);
+
+        if (!over_budget && shortest.span_sec() < period_ && (timeout_ == 0 || longest.span_sec() < timeout_)) {
+            // Wait until all inputs have data for a whole period
+            taligned_table_->watch(end);
+            return false;
+        }
+
+        return true;
+    }
+
+    // Stream mode: all pending rows up to the watermark, plus any rows that are
+    // more than timeout_ older than the latest one. Returns false if there's
+    // nothing to extract yet.
+    bool next_stream(const TimeBounds & bounds, bool over_budget, TimeStamp & start, TimeStamp & end) {
+        start = std::max(bounds.earliest_start, emitted_end_);
+        end = after(bounds.watermark);
+
+        if (bounds.valid && timeout_ > 0) {
+            TimeStamp late = bounds.latest_end;
+            epicsTimeAddSeconds(&late.ts, -timeout_);
+            end = std::max(end, after(late));
+        }
+
+        if (bounds.valid && over_budget)
+            end = after(bounds.latest_end);
+
+        log_debug_printf(REACTOR_LOG, "Considering watermark=%u.%09u%s\n",
+            bounds.watermark.ts.secPastEpoch, bounds.watermark.ts.nsec,
+            over_budget ? " (over memory budget)" : "");
+
+        if (!bounds.valid || end <= start) {
+            // Wait until all inputs move past the watermark
+            taligned_table_->watch(after(bounds.watermark));
+            return false;
+        }
+
+        return true;
+    }
+
 public:
     Reactor(
         std::shared_ptr<pvxs::MPMCFIFO<Runnable*>> dead,
         const std::shared_ptr<TimeAlignedTable> & taligned_table, double period,
-        double timeout, pvxs::server::SharedPV & pv)
+        double timeout, Mode mode, double catchup, size_t max_rows, pvxs::server::SharedPV & pv)
     : Runnable(typeid(Reactor).name(), dead),
-      taligned_table_(taligned_table), period_(period), timeout_(timeout), pv_(pv)
+      taligned_table_(taligned_table), period_(period), timeout_(timeout), mode_(mode),
+      catchup_(catchup), max_rows_(max_rows), pv_(pv),
+      emitted_end_(TimeSpan::MIN_TS), load_pvlist_(), resubscribe_(), metrics_(nullptr),
+      settling_(false), settle_deadline_(), type_changed_(false)
     {
         assert(period > 0.0);
-        assert(timeout == 0 || timeout > period);
+        assert(timeout == 0 || timeout > period || mode == Mode::STREAM);
+    }
+
+    // Enables reloading the list of input PVs on SIGHUP. Must be called before start().
+    void reload_with(LoadFunc load_pvlist, ResubscribeFunc resubscribe) {
+        load_pvlist_ = load_pvlist;
+        resubscribe_ = resubscribe;
+    }
+
+    // Publishes metrics to the given object, owned by the caller. Must be called before start().
+    void report_to(MergerMetrics *metrics) {
+        metrics_ = metrics;
     }
 
     bool prepare(double sleepPeriod) {
@@ -207,10 +543,20 @@ public:
     virtual void run() {
         double sleepPeriod = period_ / 5.0;
 
+        // Pushes wake us up as soon as there's enough data for an extraction.
+        // Still, check at least once per period for laggards, memory budget and timeouts.
+        double waitPeriod = period_;
+
+        // Give up if nothing gets extracted for this long
+        double idleTimeout = timeout_ > 0 ? std::max(timeout_, period_) : 0.0;
+
         log_info_printf(REACTOR_LOG, "Starting%s\n", "");
         log_info_printf(REACTOR_LOG, "  period=%.6f s\n", period_);
         log_info_printf(REACTOR_LOG, "  timeout=%.6f s\n", timeout_);
-        log_info_printf(REACTOR_LOG, "  refresh=%.6f s\n", sleepPeriod);
+        log_info_printf(REACTOR_LOG, "  mode=%s\n", mode_ == Mode::STREAM ? "stream" : "window");
+        log_info_printf(REACTOR_LOG, "  catchup=%.6f s\n", catchup_);
+        log_info_printf(REACTOR_LOG, "  max-rows=%lu\n", max_rows_);
+        log_info_printf(REACTOR_LOG, "  refresh=%.6f s\n", waitPeriod);
 
         if (!prepare(sleepPeriod)) {
             log_info_printf(REACTOR_LOG, "Ending%s\n", "");
@@ -225,55 +571,168 @@ public:
         epicsTimeStamp last_update;
         epicsTimeGetCurrent(&last_update);
 
+        auto last_overflow_stats = taligned_table_->get_overflow_stats();
+
+        epicsTimeStamp last_report = last_update;
+        TimeAlignedTable::Latency input_latency = TimeAlignedTable::Latency();
+        double output_lag = 0;
+        size_t output_tables = 0;
+
         while (running_) {
             epicsTimeStamp now;
             epicsTimeGetCurrent(&now);
 
             double secs_since_last_update = epicsTimeDiffInSeconds(&now, &last_update);
 
-            if (timeout_ > 0 && secs_since_last_update > timeout_) {
+            if (idleTimeout > 0 && secs_since_last_update > idleTimeout) {
                 log_err_printf(
                     REACTOR_LOG, "Timed out waiting for updates. Waited for %.1f sec (timeout=%.1f sec)\n",
-                    secs_since_last_update, timeout_
+                    secs_since_last_update, idleTimeout
                 );
                 break;
             }
 
-            TimeBounds bounds = taligned_table_->get_timebounds();
+            // Input changes take effect between extractions, so no table mixes old and new types
+            if (reload_requested) {
+                reload_requested = 0;
+                reload();
+            }
 
-            if (!bounds.valid) {
-                epicsThreadSleep(sleepPeriod);
+            // Waiting for a reload to settle doesn't count as idle
+            if (!settle()) {
+                epicsTimeGetCurrent(&last_update);
+                taligned_table_->wait(waitPeriod);
                 continue;
             }
 
-            TimeSpan shortest(bounds.earliest_start, bounds.earliest_end);
-            TimeSpan longest(bounds.earliest_start, bounds.latest_end);
-
-            log_debug_printf(REACTOR_LOG, "Considering timespans shortest=%.6f s, longest=%.6f\n",
-                shortest.span_sec(), longest.span_sec());
-
-            if (shortest.span_sec() < period_ && longest.span_sec() < timeout_) {
-                epicsThreadSleep(sleepPeriod);
-                continue;
+            // Extract everything that is ready back to back, so a backlog clears
+            // as fast as possible, unless that takes longer than the catch-up budget
+            epicsTimeStamp burst_start;
+            epicsTimeGetCurrent(&burst_start);
+
+            TimeBounds bounds;
+            size_t extracted = 0;
+            bool exhausted = false;
+
+            while (running_) {
+                bool over_budget = taligned_table_->check_budget();
+                bounds = taligned_table_->get_timebounds();
+                TimeStamp start, end;
+
+                bool ready = mode_ == Mode::STREAM
+                    ? next_stream(bounds, over_budget, start, end)
+                    : next_window(bounds, over_budget, start, end);
+
+                if (!ready)
+                    break;
+
+                if (mode_ == Mode::STREAM) {
+                    log_debug_printf(REACTOR_LOG, "Extracting merged table: %u.%09u -- %u.%09u\n",
+                        start.ts.secPastEpoch, start.ts.nsec, end.ts.secPastEpoch, end.ts.nsec);
+                } else {
+                    log_info_printf(REACTOR_LOG, "Extracting merged table spanning %.3f sec: %u.%u -- %u.%u\n",
+                        epicsTimeDiffInSeconds(&end.ts, &start.ts), start.ts.secPastEpoch, start.ts.nsec,
+                        end.ts.secPastEpoch, end.ts.nsec);
+                }
+
+                auto value = taligned_table_->extract(start, end, max_rows_, &emitted_end_);
+
+                epicsTimeStamp post_start;
+                epicsTimeGetCurrent(&post_start);
+                pv_.post(value);
+                epicsTimeGetCurrent(&last_update);
+                ++extracted;
+
+                if (metrics_) {
+                    auto timing = taligned_table_->get_extract_timing();
+                    metrics_->record(MergerMetrics::LOCK_WAIT, timing.lock_wait);
+                    metrics_->record(MergerMetrics::MERGE, timing.merge);
+                    metrics_->record(MergerMetrics::COPY, timing.copy);
+                    metrics_->record(MergerMetrics::POST, epicsTimeDiffInSeconds(&last_update, &post_start));
+                }
+
+                auto overflow_stats = taligned_table_->get_overflow_stats();
+                if (overflow_stats.drop_oldest != last_overflow_stats.drop_oldest ||
+                    overflow_stats.force_extract != last_overflow_stats.force_extract)
+                {
+                    log_info_printf(REACTOR_LOG, "Memory budget exceeded: %lu drops (%lu rows), %lu forced extractions so far\n",
+                        overflow_stats.drop_oldest, overflow_stats.dropped_rows, overflow_stats.force_extract);
+                    last_overflow_stats = overflow_stats;
+                }
+
+                if (catchup_ > 0 && epicsTimeDiffInSeconds(&last_update, &burst_start) >= catchup_) {
+                    exhausted = true;
+                    break;
+                }
             }
 
-            TimeStamp start = bounds.earliest_start;
-            TimeStamp end = start;
-            epicsTimeAddSeconds(&end.ts, period_);
+            if (extracted > 0) {
+                // How far behind real time the merged PV is, and how much data is still buffered
+                double lag = epicsTimeDiffInSeconds(&last_update, &emitted_end_.ts);
+                double backlog = bounds.valid && bounds.latest_end > emitted_end_
+                    ? epicsTimeDiffInSeconds(&bounds.latest_end.ts, &emitted_end_.ts) : 0.0;
+
+                if (extracted > 1 || exhausted) {
+                    log_info_printf(REACTOR_LOG, "Caught up %lu tables in %.3f s%s: %.3f s behind real time, %.3f s buffered\n",
+                        extracted, epicsTimeDiffInSeconds(&last_update, &burst_start),
+                        exhausted ? " (catch-up budget exhausted)" : "", lag, backlog);
+                } else {
+                    log_debug_printf(REACTOR_LOG, "%.3f s behind real time, %.3f s buffered\n", lag, backlog);
+                }
+
+                // Latency added by this merger on top of its inputs' (i.e. by each level of a merger
+                // tree), averaged over a while so it can be reported at info level
+                auto latency = taligned_table_->take_input_latency();
+                input_latency.count += latency.count;
+                input_latency.total += latency.total;
+                input_latency.max = std::max(input_latency.max, latency.max);
+                output_lag += lag * extracted;
+                output_tables += extracted;
+
+                if (epicsTimeDiffInSeconds(&last_update, &last_report) >= LATENCY_REPORT_PERIOD && input_latency.count > 0) {
+                    double input_lag = input_latency.total / input_latency.count;
+                    output_lag /= output_tables;
+
+                    log_info_printf(REACTOR_LOG, "Inputs arrived %.3f s behind real time (max %.3f s), outputs were %.3f s behind: this merger added %.3f s\n",
+                        input_lag, input_latency.max, output_lag, output_lag - input_lag);
+
+                    input_latency = TimeAlignedTable::Latency();
+                    output_lag = 0;
+                    output_tables = 0;
+                    last_report = last_update;
+                }
+
+                // In steady state, output columns should only reuse memory
+                auto arena_stats = taligned_table_->get_arena_stats();
+                log_debug_printf(REACTOR_LOG, "Output columns: %lu allocated, %lu reused, %lu unpooled, %lu bytes cached\n",
+                    arena_stats.allocations, arena_stats.reuses, arena_stats.unpooled, arena_stats.cached_bytes);
+            }
 
-            log_info_printf(REACTOR_LOG, "Extracting merged table spanning %.3f sec: %u.%u -- %u.%u\n",
-                epicsTimeDiffInSeconds(&end.ts, &start.ts), start.ts.secPastEpoch, start.ts.nsec,
-                end.ts.secPastEpoch, end.ts.nsec);
+            if (metrics_ && metrics_->since_publish() >= std::max(period_, METRICS_MIN_PERIOD))
+                metrics_->publish(taligned_table_->get_input_stats());
 
-            auto value = taligned_table_->extract(start, end);
-            pv_.post(value);
-            epicsTimeGetCurrent(&last_update);
+            if (exhausted) {
+                // Leave the rest of the period to everyone else
+                epicsThreadSleep(std::max(period_ - catchup_, 0.0));
+            } else {
+                taligned_table_->wait(waitPeriod);
+            }
         }
 
         log_info_printf(REACTOR_LOG, "Ending%s\n", "");
         stopped();
     }
 
+    void stop(double delay) {
+        if (running_) {
+            running_ = false;
+            // Ensure we don't wait for the next update to notice
+            taligned_table_->wake();
+            thread_.exitWait(delay);
+            dead_->push(this);
+        }
+    }
+
     virtual ~Reactor() {}
 };
 
@@ -282,9 +741,15 @@ static std::vector<std::string> pvlist_from_file(const std::string & filename) {
     std::ifstream filestream(filename);
     std::string line;
     std::vector<std::string> pvlist;
-
-    while(std::getline(filestream, line))
-        pvlist.push_back(line);
+    std::set<std::string> seen;
+
+    // Each PV gets a single subscription, so only its first line counts
+    while(std::getline(filestream, line)) {
+        if (seen.insert(line).second)
+            pvlist.push_back(line);
+        else
+            log_warn_printf(LOG, "Ignoring duplicate PV %s in %s\n", line.c_str(), filename.c_str());
+    }
 
     return pvlist;
 }
@@ -293,7 +758,22 @@ int main (int argc, char *argv[]) {
     std::string pvlist_file;
     double period_sec;
     double timeout_sec = 0.0;
+    size_t listener_threads = 1;
+    size_t extract_threads = 1;
+    std::string align = "timestamp";
+    std::string validity = "columns";
+    double sparse_fill = 0.0;
+    std::string mode = "window";
+    double catchup_sec = 0.0;
+    size_t max_rows = 0;
+    size_t input_budget_mb = 0;
+    size_t total_budget_mb = 0;
+    std::string overflow_policy = "drop-oldest";
     std::string pvname;
+    std::string metrics_prefix;
+    std::string record_file;
+    std::string replay_file;
+    double replay_speed = 1.0;
     std::string label_sep = ".";
     std::string col_sep = "_";
 
@@ -305,17 +785,77 @@ int main (int argc, char *argv[]) {
             & clipp::value("pvlist", pvlist_file),
 
         clipp::required("--period-sec")
-            .doc("Update publication period, in seconds.")
+            .doc("Update publication period, in seconds. In stream mode, how often to check for laggards.")
             & clipp::value("period_sec", period_sec),
 
         clipp::option("--timeout-sec")
-            .doc("Time window to wait for laggards, in seconds. Default: 0 (wait forever).")
+            .doc("Time window to wait for laggards, in seconds. In stream mode, the allowed lateness. Default: 0 (wait forever).")
             & clipp::value("timeout_sec", timeout_sec),
 
+        clipp::option("--mode")
+            .doc("When merged tables are published: 'window' (one period at a time, once all input PVs cover it) or 'stream' (every row as soon as all input PVs moved past it). Default: 'window'.")
+            & clipp::value("mode", mode),
+
+        clipp::option("--catchup-sec")
+            .doc("Maximum time, in seconds, spent publishing backlogged tables back to back. After that, pause for the rest of the period. If 0, don't limit. Default: 0.")
+            & clipp::value("catchup_sec", catchup_sec),
+
+        clipp::option("--max-rows")
+            .doc("Maximum number of rows in each published table. Larger tables are split. If 0, don't limit. Default: 0.")
+            & clipp::value("max_rows", max_rows),
+
+        clipp::option("--align")
+            .doc("How rows from different input PVs are matched: 'timestamp' (full timestamp, including pulse id) or 'pulse-id' (pulse id only). Default: 'timestamp'.")
+            & clipp::value("align", align),
+
+        clipp::option("--validity")
+            .doc("How the validity of each input PV's rows is published: 'columns' (one bool column per input PV) or 'bitmap' (one packed UInt64 column per group of 64 input PVs). Default: 'columns'.")
+            & clipp::value("validity", validity),
+
+        clipp::option("--sparse-fill")
+            .doc("Publish only the valid rows of an input PV, along with their row numbers, in the tables where less than this fraction of its rows are valid. If 0, always publish all rows. Default: 0.")
+            & clipp::value("sparse_fill", sparse_fill),
+
+        clipp::option("--input-budget-mb")
+            .doc("Maximum amount of data, in MB, to buffer for a single input PV. If 0, don't limit. Default: 0.")
+            & clipp::value("input_budget_mb", input_budget_mb),
+
+        clipp::option("--total-budget-mb")
+            .doc("Maximum amount of data, in MB, to buffer for all input PVs. If 0, don't limit. Default: 0.")
+            & clipp::value("total_budget_mb", total_budget_mb),
+
+        clipp::option("--overflow-policy")
+            .doc("What to do when buffered data exceeds a budget: 'drop-oldest' (drop the oldest rows of the largest inputs) or 'force-extract' (publish without waiting for laggards, which are marked invalid). Default: 'drop-oldest'.")
+            & clipp::value("overflow_policy", overflow_policy),
+
+        clipp::option("--listener-threads")
+            .doc("Number of threads receiving input PV updates. Input PVs are split evenly among them. Default: 1.")
+            & clipp::value("listener_threads", listener_threads),
+
+        clipp::option("--extract-threads")
+            .doc("Number of threads building the columns of each merged table. Default: 1.")
+            & clipp::value("extract_threads", extract_threads),
+
         clipp::required("--pvname")
             .doc("Name of the output PV.")
             & clipp::value("pvname", pvname),
 
+        clipp::option("--metrics-prefix")
+            .doc("If given, serve metrics PVs <metrics_prefix>INPUTS (statistics of each input PV) and <metrics_prefix>STAGES (timing of each publication stage).")
+            & clipp::value("metrics_prefix", metrics_prefix),
+
+        clipp::option("--record")
+            .doc("If given, write every update received from the input PVs to this file, to be replayed later.")
+            & clipp::value("record_file", record_file),
+
+        clipp::option("--replay")
+            .doc("If given, don't subscribe to the input PVs: feed them the updates recorded in this file instead. Exit once they were all published.")
+            & clipp::value("replay_file", replay_file),
+
+        clipp::option("--replay-speed")
+            .doc("Replay speed, relative to the pace the updates were recorded at. If 0, replay as fast as possible. Default: 1.")
+            & clipp::value("replay_speed", replay_speed),
+
         clipp::option("--label-sep")
             .doc(std::string("Separator between PV name and column name in labels. Default: '") + label_sep + "'.")
             & clipp::value("label_sep", label_sep),
@@ -343,7 +883,17 @@ int main (int argc, char *argv[]) {
         } while(0)
 
     VALIDATE_ARG(period_sec <= 0.0, "Invalid period: %.6f seconds\n", period_sec);
-    VALIDATE_ARG(timeout_sec < 0.0 || (timeout_sec > 0 && timeout_sec < period_sec), "Invalid timeout: %.6f seconds\n", timeout_sec);
+    VALIDATE_ARG(mode != "window" && mode != "stream", "Invalid mode: %s\n", mode.c_str());
+    VALIDATE_ARG(timeout_sec < 0.0 || (mode == "window" && timeout_sec > 0 && timeout_sec < period_sec), "Invalid timeout: %.6f seconds\n", timeout_sec);
+    VALIDATE_ARG(catchup_sec < 0.0, "Invalid catch-up budget: %.6f seconds\n", catchup_sec);
+    VALIDATE_ARG(align != "timestamp" && align != "pulse-id", "Invalid alignment: %s\n", align.c_str());
+    VALIDATE_ARG(validity != "columns" && validity != "bitmap", "Invalid validity layout: %s\n", validity.c_str());
+    VALIDATE_ARG(sparse_fill < 0.0 || sparse_fill > 1.0, "Invalid sparse fill ratio: %.6f\n", sparse_fill);
+    VALIDATE_ARG(overflow_policy != "drop-oldest" && overflow_policy != "force-extract", "Invalid overflow policy: %s\n", overflow_policy.c_str());
+    VALIDATE_ARG(listener_threads == 0, "Invalid number of listener threads: %lu\n", listener_threads);
+    VALIDATE_ARG(extract_threads == 0, "Invalid number of extract threads: %lu\n", extract_threads);
+    VALIDATE_ARG(!record_file.empty() && !replay_file.empty(), "Can't record while replaying: %s\n", record_file.c_str());
+    VALIDATE_ARG(replay_speed < 0.0, "Invalid replay speed: %.6f\n", replay_speed);
     #undef VALIDATE_ARG
 
     std::vector<std::string> pvlist(pvlist_from_file(pvlist_file));
@@ -353,25 +903,119 @@ int main (int argc, char *argv[]) {
     log_info_printf(LOG, "  pvlist=%s [%lu PVs]\n", pvlist_file.c_str(), pvlist.size());
     log_info_printf(LOG, "  period=%.6f s\n", period_sec);
     log_info_printf(LOG, "  timeout=%.6f s%s\n", timeout_sec, timeout_sec == 0 ? " (wait forever)" : "");
+    log_info_printf(LOG, "  mode=%s\n", mode.c_str());
+    log_info_printf(LOG, "  catchup=%.6f s%s\n", catchup_sec, catchup_sec == 0 ? " (no limit)" : "");
+    log_info_printf(LOG, "  max-rows=%lu%s\n", max_rows, max_rows == 0 ? " (no limit)" : "");
+    log_info_printf(LOG, "  align=%s\n", align.c_str());
+    log_info_printf(LOG, "  validity=%s\n", validity.c_str());
+    log_info_printf(LOG, "  sparse-fill=%.6f%s\n", sparse_fill, sparse_fill == 0 ? " (always dense)" : "");
+    log_info_printf(LOG, "  input-budget=%lu MB%s\n", input_budget_mb, input_budget_mb == 0 ? " (no limit)" : "");
+    log_info_printf(LOG, "  total-budget=%lu MB%s\n", total_budget_mb, total_budget_mb == 0 ? " (no limit)" : "");
+    log_info_printf(LOG, "  overflow-policy=%s\n", overflow_policy.c_str());
+    log_info_printf(LOG, "  listener-threads=%lu\n", listener_threads);
+    log_info_printf(LOG, "  extract-threads=%lu\n", extract_threads);
     log_info_printf(LOG, "  pvname=%s\n", pvname.c_str());
+    log_info_printf(LOG, "  metrics-prefix=%s%s\n", metrics_prefix.c_str(), metrics_prefix.empty() ? " (no metrics)" : "");
+    log_info_printf(LOG, "  record=%s%s\n", record_file.c_str(), record_file.empty() ? " (don't record)" : "");
+    log_info_printf(LOG, "  replay=%s%s\n", replay_file.c_str(), replay_file.empty() ? " (live inputs)" : "");
+    if (!replay_file.empty())
+        log_info_printf(LOG, "  replay-speed=%.3f%s\n", replay_speed, replay_speed == 0 ? " (as fast as possible)" : "");
     log_info_printf(LOG, "  label-sep=%s\n", label_sep.c_str());
     log_info_printf(LOG, "  column-sep=%s\n", col_sep.c_str());
 
     // Shared objects
     auto dead_queue = std::make_shared<pvxs::MPMCFIFO<Runnable*>>();
-    auto taligned_table(std::make_shared<TimeAlignedTable>(pvlist, label_sep, col_sep));
+    auto taligned_table(std::make_shared<TimeAlignedTable>(pvlist, label_sep, col_sep, extract_threads,
+        align == "pulse-id" ? TimeAlignedTable::Alignment::PULSE_ID : TimeAlignedTable::Alignment::TIMESTAMP,
+        validity == "bitmap" ? TimeAlignedTable::Validity::BITMAP : TimeAlignedTable::Validity::COLUMNS));
     pvxs::server::SharedPV pv(pvxs::server::SharedPV::buildReadonly());
 
-    // Prepare workers
-    Listener listener(dead_queue, pvlist, taligned_table);
-    Reactor reactor(dead_queue, taligned_table, period_sec, timeout_sec, pv);
+    taligned_table->set_memory_budget(input_budget_mb * 1024 * 1024, total_budget_mb * 1024 * 1024,
+        overflow_policy == "force-extract" ? TimeAlignedTable::OverflowPolicy::FORCE_EXTRACT
+                                           : TimeAlignedTable::OverflowPolicy::DROP_OLDEST);
+
+    taligned_table->set_sparse_fill(sparse_fill);
+
+    std::shared_ptr<Recorder> recorder;
+    std::unique_ptr<Replayer> replayer;
+
+    try {
+        if (!record_file.empty())
+            recorder = std::make_shared<Recorder>(record_file);
+
+        if (!replay_file.empty()) {
+            std::unique_ptr<Recording> recording(new Recording(replay_file));
+            replayer.reset(new Replayer(dead_queue, std::move(recording), taligned_table, replay_speed, period_sec + timeout_sec));
+        }
+    } catch (std::runtime_error & e) {
+        log_err_printf(LOG, "%s\n", e.what());
+        return 1;
+    }
+
+    // Prepare workers. Each input PV is handled by exactly one Listener,
+    // so every input buffer has a single producer. A replay takes their place.
+    pvxs::client::Context client(pvxs::client::Context::fromEnv());
+    std::vector<std::vector<std::string>> listener_pvlists(std::min(listener_threads, std::max<size_t>(pvlist.size(), 1)));
+
+    for (size_t i = 0; i < pvlist.size(); ++i)
+        listener_pvlists[i % listener_pvlists.size()].push_back(pvlist[i]);
+
+    std::vector<std::unique_ptr<Listener>> listeners;
+    if (!replayer) {
+        for (const auto & listener_pvlist : listener_pvlists)
+            listeners.emplace_back(new Listener(dead_queue, client, listener_pvlist, taligned_table, recorder));
+    }
+
+    // Outlives the reactor, which reports to it
+    std::unique_ptr<MergerMetrics> metrics;
+
+    Reactor reactor(dead_queue, taligned_table, period_sec, timeout_sec,
+        mode == "stream" ? Reactor::Mode::STREAM : Reactor::Mode::WINDOW, catchup_sec, max_rows, pv);
+
+    // SIGHUP reloads the list of input PVs. New PVs go to the listeners with the fewest subscriptions.
+    reactor.reload_with(
+        [&pvlist_file]() {
+            return pvlist_from_file(pvlist_file);
+        },
+        [&listeners](const std::vector<std::string> & added, const std::vector<std::string> & removed) {
+            for (const auto & name : removed) {
+                for (auto & listener : listeners)
+                    listener->unsubscribe(name);
+            }
+
+            // Replays have no subscriptions to change
+            if (listeners.empty())
+                return;
+
+            for (const auto & name : added) {
+                auto least_busy = std::min_element(listeners.begin(), listeners.end(),
+                    [](const std::unique_ptr<Listener> & a, const std::unique_ptr<Listener> & b) {
+                        return a->num_subscriptions() < b->num_subscriptions();
+                    });
+
+                (*least_busy)->subscribe(name);
+            }
+        });
+
+    signal(SIGHUP, request_reload);
 
     // Prepare server
     pvxs::server::Server server(pvxs::server::Config::fromEnv().build());
     server.addPV(pvname, pv);
 
+    if (!metrics_prefix.empty()) {
+        metrics.reset(new MergerMetrics(metrics_prefix));
+        metrics->attach(server);
+        reactor.report_to(metrics.get());
+    }
+
     // Run workers and server
-    listener.start();
+    for (auto & listener : listeners)
+        listener->start();
+
+    if (replayer)
+        replayer->start();
+
     reactor.start();
     server.start();
 
@@ -379,17 +1023,27 @@ int main (int argc, char *argv[]) {
     // CTRL+C is handled by the Server thread
     auto dead = dead_queue->pop();
 
-    // Close the PV, stop the server
+    // Close the PVs, stop the server
     pv.close();
+    if (metrics)
+        metrics->close();
     server.stop();
 
     // Ask other threads to stop, if they are not dead yet
-    if (dynamic_cast<Runnable*>(&listener) != dead)
-        listener.stop(1.0);
+    for (auto & listener : listeners) {
+        if (dynamic_cast<Runnable*>(listener.get()) != dead)
+            listener->stop(1.0);
+    }
+
+    if (replayer && dynamic_cast<Runnable*>(replayer.get()) != dead)
+        replayer->stop(1.0);
 
     if (dynamic_cast<Runnable*>(&reactor) != dead)
         reactor.stop(1.0);
 
+    if (recorder)
+        log_info_printf(LOG, "Recorded %lu updates to %s\n", recorder->num_updates(), record_file.c_str());
+
     log_info_printf(LOG, "Exiting%s\n", "");
 
     return 0;
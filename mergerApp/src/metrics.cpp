@@ -0,0 +1,177 @@
+#include "metrics.h"
+
+#include <algorithm>
+
+#include <pvxs/log.h>
+
+DEFINE_LOGGER(LOG, "merger.metrics");
+
+namespace tabulator {
+
+static const char *STAGE_NAMES[MergerMetrics::NUM_STAGES] = {
+    "lock_wait", "merge", "copy", "post"
+};
+
+static const std::vector<nt::NTTable::ColumnSpec> INPUTS_COLUMNS {
+    { pvxs::TypeCode::StringA,  "pvname",              "PV name" },
+    { pvxs::TypeCode::BoolA,    "active",              "Active" },
+    { pvxs::TypeCode::Float64A, "updates_per_sec",     "Updates/s" },
+    { pvxs::TypeCode::Float64A, "rows_per_sec",        "Rows/s" },
+    { pvxs::TypeCode::UInt64A,  "buffered_rows",       "Buffered rows" },
+    { pvxs::TypeCode::UInt64A,  "buffered_bytes",      "Buffered bytes" },
+    { pvxs::TypeCode::Float64A, "last_update_age_sec", "Last update age (s)" },
+    { pvxs::TypeCode::UInt64A,  "dropped_rows",        "Dropped rows" },
+    { pvxs::TypeCode::UInt64A,  "late_rows",           "Late rows" },
+    { pvxs::TypeCode::Float64A, "valid_fraction",      "Valid fraction" },
+};
+
+static const std::vector<nt::NTTable::ColumnSpec> STAGES_COLUMNS {
+    { pvxs::TypeCode::StringA,  "stage",    "Stage" },
+    { pvxs::TypeCode::UInt64A,  "count",    "Count" },
+    { pvxs::TypeCode::Float64A, "last_sec", "Last (s)" },
+    { pvxs::TypeCode::Float64A, "mean_sec", "Mean (s)" },
+    { pvxs::TypeCode::Float64A, "max_sec",  "Max (s)" },
+};
+
+MergerMetrics::MergerMetrics(const std::string & prefix)
+: inputs_pvname_(prefix + "INPUTS"), stages_pvname_(prefix + "STAGES"),
+  inputs_type_(INPUTS_COLUMNS.begin(), INPUTS_COLUMNS.end()),
+  stages_type_(STAGES_COLUMNS.begin(), STAGES_COLUMNS.end()),
+  inputs_pv_(pvxs::server::SharedPV::buildReadonly()),
+  stages_pv_(pvxs::server::SharedPV::buildReadonly()),
+  stages_(), previous_(), last_publish_()
+{
+    epicsTimeGetCurrent(&last_publish_);
+}
+
+void MergerMetrics::attach(pvxs::server::Server & server) {
+    inputs_pv_.open(inputs_type_.create());
+    stages_pv_.open(stages_type_.create());
+
+    server.addPV(inputs_pvname_, inputs_pv_);
+    server.addPV(stages_pvname_, stages_pv_);
+
+    log_info_printf(LOG, "Serving metrics at %s and %s\n", inputs_pvname_.c_str(), stages_pvname_.c_str());
+}
+
+void MergerMetrics::close() {
+    inputs_pv_.close();
+    stages_pv_.close();
+}
+
+void MergerMetrics::record(Stage stage, double seconds) {
+    auto & timing = stages_[stage];
+    ++timing.count;
+    timing.last = seconds;
+    timing.total += seconds;
+    timing.max = std::max(timing.max, seconds);
+}
+
+double MergerMetrics::since_publish() const {
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+    return epicsTimeDiffInSeconds(&now, &last_publish_);
+}
+
+void MergerMetrics::publish(const std::vector<TimeAlignedTable::InputStats> & inputs) {
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+
+    double elapsed = epicsTimeDiffInSeconds(&now, &last_publish_);
+    size_t n = inputs.size();
+
+    // Inputs
+    pvxs::shared_array<std::string> pvname(n);
+    pvxs::shared_array<bool> active(n);
+    pvxs::shared_array<double> updates_per_sec(n);
+    pvxs::shared_array<double> rows_per_sec(n);
+    pvxs::shared_array<uint64_t> buffered_rows(n);
+    pvxs::shared_array<uint64_t> buffered_bytes(n);
+    pvxs::shared_array<double> last_update_age(n);
+    pvxs::shared_array<uint64_t> dropped_rows(n);
+    pvxs::shared_array<uint64_t> late_rows(n);
+    pvxs::shared_array<double> valid_fraction(n);
+
+    std::map<std::string, TimeAlignedTable::InputStats> current;
+
+    for (size_t i = 0; i < n; ++i) {
+        const auto & input = inputs[i];
+
+        // Inputs that weren't there at the previous publication start from zero
+        auto prev = previous_.find(input.name);
+        size_t prev_updates = 0, prev_rows = 0, prev_valid = 0, prev_total = 0;
+
+        if (prev != previous_.end()) {
+            prev_updates = prev->second.pushed.updates;
+            prev_rows = prev->second.pushed.rows;
+            prev_valid = prev->second.valid_rows;
+            prev_total = prev->second.table_rows;
+        }
+
+        size_t table_rows = input.table_rows - prev_total;
+
+        pvname[i] = input.name;
+        active[i] = input.active;
+        updates_per_sec[i] = elapsed > 0 ? (input.pushed.updates - prev_updates) / elapsed : 0.0;
+        rows_per_sec[i] = elapsed > 0 ? (input.pushed.rows - prev_rows) / elapsed : 0.0;
+        buffered_rows[i] = input.buffered_rows;
+        buffered_bytes[i] = input.buffered_bytes;
+        last_update_age[i] = input.pushed.updates > 0 ? epicsTimeDiffInSeconds(&now, &input.pushed.last_push) : -1.0;
+        dropped_rows[i] = input.dropped_rows;
+        late_rows[i] = input.late_rows;
+        valid_fraction[i] = table_rows > 0 ? double(input.valid_rows - prev_valid) / table_rows : 0.0;
+
+        current.emplace(input.name, input);
+    }
+
+    auto inputs_value = inputs_type_.create();
+    auto inputs_columns = inputs_value[nt::NTTable::COLUMNS_FIELD];
+    inputs_columns["pvname"] = pvname.freeze();
+    inputs_columns["active"] = active.freeze();
+    inputs_columns["updates_per_sec"] = updates_per_sec.freeze();
+    inputs_columns["rows_per_sec"] = rows_per_sec.freeze();
+    inputs_columns["buffered_rows"] = buffered_rows.freeze();
+    inputs_columns["buffered_bytes"] = buffered_bytes.freeze();
+    inputs_columns["last_update_age_sec"] = last_update_age.freeze();
+    inputs_columns["dropped_rows"] = dropped_rows.freeze();
+    inputs_columns["late_rows"] = late_rows.freeze();
+    inputs_columns["valid_fraction"] = valid_fraction.freeze();
+
+    // Stages
+    pvxs::shared_array<std::string> stage(NUM_STAGES);
+    pvxs::shared_array<uint64_t> count(NUM_STAGES);
+    pvxs::shared_array<double> last(NUM_STAGES);
+    pvxs::shared_array<double> mean(NUM_STAGES);
+    pvxs::shared_array<double> max(NUM_STAGES);
+
+    for (size_t i = 0; i < NUM_STAGES; ++i) {
+        const auto & timing = stages_[i];
+        stage[i] = STAGE_NAMES[i];
+        count[i] = timing.count;
+        last[i] = timing.last;
+        mean[i] = timing.count > 0 ? timing.total / timing.count : 0.0;
+        max[i] = timing.max;
+    }
+
+    auto stages_value = stages_type_.create();
+    auto stages_columns = stages_value[nt::NTTable::COLUMNS_FIELD];
+    stages_columns["stage"] = stage.freeze();
+    stages_columns["count"] = count.freeze();
+    stages_columns["last_sec"] = last.freeze();
+    stages_columns["mean_sec"] = mean.freeze();
+    stages_columns["max_sec"] = max.freeze();
+
+    inputs_pv_.post(inputs_value);
+    stages_pv_.post(stages_value);
+
+    // Start over
+    for (auto & timing : stages_)
+        timing = StageTiming();
+
+    previous_.swap(current);
+    last_publish_ = now;
+
+    log_debug_printf(LOG, "Published metrics for %lu inputs\n", n);
+}
+
+}
@@ -0,0 +1,87 @@
+#ifndef TAB_METRICS_H
+#define TAB_METRICS_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <epicsTime.h>
+
+#include <pvxs/server.h>
+#include <pvxs/sharedpv.h>
+
+#include <tab/nttable.h>
+
+#include "taligntable.h"
+
+namespace tabulator {
+
+/* MergerMetrics
+ *
+ * Serves two NTTable PVs that tell how a merger is doing:
+ *
+ *   <prefix>INPUTS   One row per input PV: update rate, rows per second, buffered
+ *                    rows and bytes, age of the last update, dropped and late rows
+ *                    and fraction of valid rows in the published tables.
+ *   <prefix>STAGES   One row per stage of a publication (lock wait, timestamp union,
+ *                    column copy and post): how many times it ran and how long it
+ *                    took (last, mean and max).
+ *
+ * Rates, fractions and timings cover the time since the previous publication,
+ * row counts are totals.
+ *
+ * Not thread safe, meant to be used by a single thread.
+ */
+class MergerMetrics {
+
+public:
+    enum Stage {
+        LOCK_WAIT,
+        MERGE,
+        COPY,
+        POST,
+        NUM_STAGES
+    };
+
+private:
+    struct StageTiming {
+        size_t count;
+        double last;
+        double total;
+        double max;
+    };
+
+    const std::string inputs_pvname_;
+    const std::string stages_pvname_;
+    const nt::NTTable inputs_type_;
+    const nt::NTTable stages_type_;
+    pvxs::server::SharedPV inputs_pv_;
+    pvxs::server::SharedPV stages_pv_;
+
+    StageTiming stages_[NUM_STAGES];
+
+    // Input statistics at the previous publication, to compute rates
+    std::map<std::string, TimeAlignedTable::InputStats> previous_;
+    epicsTimeStamp last_publish_;
+
+public:
+    MergerMetrics(const std::string & prefix);
+
+    // Adds the metrics PVs to a server and opens them
+    void attach(pvxs::server::Server & server);
+
+    void close();
+
+    // Accounts for one run of a stage
+    void record(Stage stage, double seconds);
+
+    // Seconds since the last publication
+    double since_publish() const;
+
+    // Posts the statistics of the inputs, and of the stages since the previous call
+    void publish(const std::vector<TimeAlignedTable::InputStats> & inputs);
+};
+
+}
+
+#endif
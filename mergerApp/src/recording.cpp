@@ -0,0 +1,273 @@
+#include "recording.h"
+
+#include <cstring>
+#include <stdexcept>
+
+#include <pvxs/log.h>
+
+DEFINE_LOGGER(LOG, "merger.recording");
+
+typedef epicsGuard<epicsMutex> Guard;
+
+namespace tabulator {
+
+static const char MAGIC[8] = { 'T', 'A', 'B', 'R', 'E', 'C', '0', '1' };
+
+static const char TYPE_RECORD = 'T';
+static const char UPDATE_RECORD = 'U';
+
+template<typename T>
+static void put(std::ostream & out, const T & v) {
+    out.write(reinterpret_cast<const char*>(&v), sizeof(T));
+}
+
+static void put_string(std::ostream & out, const std::string & s) {
+    put<uint32_t>(out, s.size());
+    out.write(s.data(), s.size());
+}
+
+template<typename T>
+static T get(std::istream & in) {
+    T v;
+    in.read(reinterpret_cast<char*>(&v), sizeof(T));
+    return v;
+}
+
+static std::string get_string(std::istream & in) {
+    uint32_t size = get<uint32_t>(in);
+
+    if (!in)
+        return std::string();
+
+    std::string s(size, '\0');
+    in.read(&s[0], size);
+    return s;
+}
+
+// Column specs of an NTTable value. Empty if it isn't one.
+static std::vector<nt::NTTable::ColumnSpec> columns_of(const pvxs::Value & value) {
+    std::vector<nt::NTTable::ColumnSpec> columns;
+
+    auto & labels_field = value[nt::NTTable::LABELS_FIELD];
+    auto & columns_field = value[nt::NTTable::COLUMNS_FIELD];
+
+    if (!labels_field.valid() || !columns_field.valid())
+        return columns;
+
+    const auto & labels = labels_field.as<pvxs::shared_array<const std::string>>();
+
+    if (labels.size() != columns_field.nmembers())
+        return columns;
+
+    auto columns_it = columns_field.ichildren();
+    size_t idx = 0;
+    for (auto it = columns_it.begin(); it != columns_it.end(); ++it, ++idx)
+        columns.emplace_back((*it).type(), columns_field.nameOf(*it), labels[idx]);
+
+    return columns;
+}
+
+static bool same_columns(const std::vector<nt::NTTable::ColumnSpec> & a, const std::vector<nt::NTTable::ColumnSpec> & b) {
+    if (a.size() != b.size())
+        return false;
+
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (a[i].type_code != b[i].type_code || a[i].name != b[i].name || a[i].label != b[i].label)
+            return false;
+    }
+
+    return true;
+}
+
+Recorder::Recorder(const std::string & filename)
+: lock_(), filename_(filename), out_(filename, std::ios::binary | std::ios::trunc), streams_(), num_updates_(0), failed_(false)
+{
+    if (!out_)
+        throw std::runtime_error("Can't create recording '" + filename + "'");
+
+    out_.write(MAGIC, sizeof(MAGIC));
+
+    log_info_printf(LOG, "Recording input updates to %s\n", filename_.c_str());
+}
+
+void Recorder::write_type(const std::string & pvname, const Stream & stream) {
+    put<char>(out_, TYPE_RECORD);
+    put<uint32_t>(out_, stream.id);
+    put_string(out_, pvname);
+    put<uint32_t>(out_, stream.columns.size());
+
+    for (const auto & column : stream.columns) {
+        put<uint8_t>(out_, column.type_code.code);
+        put_string(out_, column.name);
+        put_string(out_, column.label);
+    }
+}
+
+void Recorder::write(const std::string & pvname, const pvxs::Value & value) {
+    epicsTimeStamp received;
+    epicsTimeGetCurrent(&received);
+
+    auto columns = columns_of(value);
+
+    if (columns.empty()) {
+        log_debug_printf(LOG, "Not recording update of '%s': not an NTTable\n", pvname.c_str());
+        return;
+    }
+
+    Guard G(lock_);
+
+    if (failed_)
+        return;
+
+    auto stream = streams_.find(pvname);
+
+    if (stream == streams_.end()) {
+        uint32_t id = streams_.size();
+        stream = streams_.emplace(pvname, Stream{id, columns}).first;
+        write_type(pvname, stream->second);
+    } else if (!same_columns(stream->second.columns, columns)) {
+        stream->second.columns = columns;
+        write_type(pvname, stream->second);
+    }
+
+    put<char>(out_, UPDATE_RECORD);
+    put<uint32_t>(out_, stream->second.id);
+    put<uint32_t>(out_, received.secPastEpoch);
+    put<uint32_t>(out_, received.nsec);
+
+    auto columns_field = value[nt::NTTable::COLUMNS_FIELD];
+
+    for (const auto & column : columns) {
+        auto contents = columns_field[column.name].as<pvxs::shared_array<const void>>();
+        put<uint64_t>(out_, contents.size());
+
+        if (contents.original_type() == pvxs::ArrayType::String) {
+            for (const auto & s : contents.castTo<const std::string>())
+                put_string(out_, s);
+        } else {
+            out_.write(static_cast<const char*>(contents.data()), contents.size() * pvxs::elementSize(contents.original_type()));
+        }
+    }
+
+    if (!out_) {
+        log_err_printf(LOG, "Failed to write to recording '%s', recording stopped after %lu updates\n",
+            filename_.c_str(), num_updates_);
+        failed_ = true;
+        out_.close();
+        return;
+    }
+
+    ++num_updates_;
+}
+
+size_t Recorder::num_updates() const {
+    Guard G(lock_);
+    return num_updates_;
+}
+
+Recording::Recording(const std::string & filename)
+: filename_(filename), in_(filename, std::ios::binary), streams_()
+{
+    if (!in_)
+        throw std::runtime_error("Can't open recording '" + filename + "'");
+
+    char magic[sizeof(MAGIC)];
+    in_.read(magic, sizeof(magic));
+
+    if (!in_ || std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0)
+        throw std::runtime_error("'" + filename + "' is not a recording");
+}
+
+void Recording::read_type() {
+    uint32_t id = get<uint32_t>(in_);
+    std::string pvname = get_string(in_);
+    uint32_t num_columns = get<uint32_t>(in_);
+
+    std::vector<nt::NTTable::ColumnSpec> columns;
+
+    for (uint32_t i = 0; i < num_columns && in_; ++i) {
+        pvxs::TypeCode type_code(get<uint8_t>(in_));
+        std::string name = get_string(in_);
+        std::string label = get_string(in_);
+
+        if (!in_)
+            return;
+
+        if (!type_code.isarray() || type_code.kind() == pvxs::Kind::Compound)
+            throw std::runtime_error("Unexpected type of column '" + name + "' in recording '" + filename_ + "'");
+
+        columns.emplace_back(type_code, name, label);
+    }
+
+    streams_.erase(id);
+    streams_.emplace(id, Stream{pvname, columns, nt::NTTable(columns.begin(), columns.end())});
+}
+
+bool Recording::next(Update & update) {
+    while (true) {
+        char kind = get<char>(in_);
+
+        if (in_.eof())
+            return false;
+
+        if (kind == TYPE_RECORD) {
+            read_type();
+
+            if (!in_)
+                break;
+
+            continue;
+        }
+
+        if (kind != UPDATE_RECORD)
+            throw std::runtime_error("Unexpected record in recording '" + filename_ + "'");
+
+        uint32_t id = get<uint32_t>(in_);
+        auto stream = streams_.find(id);
+
+        if (in_ && stream == streams_.end())
+            throw std::runtime_error("Update of an undeclared stream in recording '" + filename_ + "'");
+
+        update.received.secPastEpoch = get<uint32_t>(in_);
+        update.received.nsec = get<uint32_t>(in_);
+
+        if (!in_)
+            break;
+
+        update.pvname = stream->second.pvname;
+        update.value = stream->second.type.create();
+
+        auto columns_field = update.value[nt::NTTable::COLUMNS_FIELD];
+
+        for (const auto & column : stream->second.columns) {
+            size_t count = get<uint64_t>(in_);
+
+            if (!in_)
+                break;
+
+            auto array_type = column.type_code.arrayType();
+            auto contents = pvxs::allocArray(array_type, count);
+
+            if (array_type == pvxs::ArrayType::String) {
+                auto strings = contents.castTo<std::string>();
+                for (auto & s : strings)
+                    s = get_string(in_);
+            } else {
+                in_.read(static_cast<char*>(contents.data()), count * pvxs::elementSize(array_type));
+            }
+
+            columns_field[column.name] = contents.freeze();
+        }
+
+        if (!in_)
+            break;
+
+        return true;
+    }
+
+    // The recorder was stopped halfway through a record
+    log_warn_printf(LOG, "Recording '%s' ends with a truncated record\n", filename_.c_str());
+    return false;
+}
+
+}
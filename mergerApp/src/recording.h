@@ -0,0 +1,112 @@
+#ifndef TAB_RECORDING_H
+#define TAB_RECORDING_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <fstream>
+
+#include <epicsTime.h>
+#include <epicsMutex.h>
+
+#include <pvxs/data.h>
+
+#include <tab/nttable.h>
+
+namespace tabulator {
+
+/* Recordings of merger input streams
+ *
+ * A recording is a binary log of the NTTable updates received by a merger, each
+ * with the time it was received. It starts with a magic string followed by a
+ * series of records, each one tagged by a single byte:
+ *
+ *   'T'  Type of a stream: stream id (u32), PV name, number of columns (u32)
+ *        and, for each column, its type code (u8), name and label.
+ *   'U'  Update of a stream: stream id (u32), receive time (u32 seconds past
+ *        the EPICS epoch, u32 nanoseconds) and, for each column, its length
+ *        (u64) and contents.
+ *
+ * Strings are stored as their length (u32) followed by their characters.
+ * Numbers are stored in the byte order of the host that wrote the recording.
+ *
+ * A stream is declared by a 'T' record before its first update, and again
+ * whenever the type of its updates changes.
+ */
+
+/* Recorder
+ *
+ * Appends updates to a recording. Safe to use from multiple threads.
+ */
+class Recorder {
+private:
+    struct Stream {
+        uint32_t id;
+        std::vector<nt::NTTable::ColumnSpec> columns;
+    };
+
+    mutable epicsMutex lock_;
+    const std::string filename_;
+    std::ofstream out_;
+    std::map<std::string, Stream> streams_;
+    size_t num_updates_;
+    bool failed_;
+
+    void write_type(const std::string & pvname, const Stream & stream);
+
+public:
+    /* Creates (or truncates) the recording file. Throws std::runtime_error
+     * if it can't be opened.
+     */
+    Recorder(const std::string & filename);
+
+    /* Appends an update of `pvname`, received now. Values that aren't
+     * NTTables are ignored. If writing fails (e.g. the disk is full), the
+     * error is logged once and recording stops: merging must go on.
+     */
+    void write(const std::string & pvname, const pvxs::Value & value);
+
+    size_t num_updates() const;
+};
+
+/* Recording
+ *
+ * Reads the updates of a recording back, in the order they were recorded.
+ * Not thread safe.
+ */
+class Recording {
+public:
+    struct Update {
+        std::string pvname;
+        epicsTimeStamp received;
+        pvxs::Value value;
+    };
+
+private:
+    struct Stream {
+        std::string pvname;
+        std::vector<nt::NTTable::ColumnSpec> columns;
+        nt::NTTable type;
+    };
+
+    const std::string filename_;
+    std::ifstream in_;
+    std::map<uint32_t, Stream> streams_;
+
+    void read_type();
+
+public:
+    /* Opens a recording. Throws std::runtime_error if it can't be opened or
+     * it isn't a recording.
+     */
+    Recording(const std::string & filename);
+
+    /* Reads the next update. Returns false at the end of the recording.
+     * Throws std::runtime_error if the recording is malformed.
+     */
+    bool next(Update & update);
+};
+
+}
+
+#endif
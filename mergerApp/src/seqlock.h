@@ -0,0 +1,71 @@
+#ifndef TAB_SEQLOCK_H
+#define TAB_SEQLOCK_H
+
+#include <atomic>
+#include <cstring>
+#include <cstdint>
+
+namespace tabulator {
+
+/* SeqLock
+ *
+ * Publishes a small value of trivially copyable type `T`, so that it can be
+ * read without locking or allocating. Readers retry if they raced with a
+ * writer, so reads are cheap as long as writes are short and infrequent
+ * compared to reads. Writers must be serialized by the caller.
+ *
+ * The value is stored as a series of atomic words, so concurrent reads and
+ * writes are well defined.
+ */
+template<typename T>
+class SeqLock {
+private:
+    static const size_t NUM_WORDS = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+    std::atomic<uint64_t> seq_;
+    std::atomic<uint64_t> words_[NUM_WORDS];
+
+public:
+    SeqLock(const T & value = T()) : seq_(0) {
+        store(value);
+    }
+
+    /* Publishes a new value. Not safe to call concurrently with itself */
+    void store(const T & value) {
+        uint64_t buf[NUM_WORDS] = {};
+        std::memcpy(buf, &value, sizeof(T));
+
+        uint64_t seq = seq_.load(std::memory_order_relaxed);
+        seq_.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        for (size_t i = 0; i < NUM_WORDS; ++i)
+            words_[i].store(buf[i], std::memory_order_relaxed);
+
+        seq_.store(seq + 2, std::memory_order_release);
+    }
+
+    /* Returns the latest published value. Safe to call from any thread */
+    T load() const {
+        uint64_t buf[NUM_WORDS];
+        uint64_t before, after;
+
+        do {
+            before = seq_.load(std::memory_order_acquire);
+
+            for (size_t i = 0; i < NUM_WORDS; ++i)
+                buf[i] = words_[i].load(std::memory_order_relaxed);
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            after = seq_.load(std::memory_order_relaxed);
+        } while ((before & 1) || before != after);
+
+        T value;
+        std::memcpy(&value, buf, sizeof(T));
+        return value;
+    }
+};
+
+}
+
+#endif
@@ -1,7 +1,11 @@
 #include "tablebuffer.h"
 
+#include <stdexcept>
+
 #include <epicsStdio.h>
 
+typedef epicsGuard<epicsMutex> Guard;
+
 namespace tabulator {
 
 // TODO: move timespan to util::ts
@@ -16,23 +20,7 @@ TimeSpan::TimeSpan() {
 
 TimeSpan::TimeSpan(const TimeStamp & start, const TimeStamp & end)
 : valid(true), start(start), end(end)
-{
-    char message[1024];
-
-    epicsSnprintf(message, sizeof(message),
-        "TimeSpan start=%u.%09u.%016lX end=%u%.09u.%016lX",
-        start.ts.secPastEpoch, start.ts.nsec, start.utag,
-        end.ts.secPastEpoch, end.ts.nsec, end.utag);
-
-    if (start > end) {
-        //char message[1024];
-        epicsSnprintf(message, sizeof(message),
-            "TimeSpan expected to have start=%u.%09u.%016lX before end=%u%.09u.%016lX",
-            start.ts.secPastEpoch, start.ts.nsec, start.utag,
-            end.ts.secPastEpoch, end.ts.nsec, end.utag);
-        //throw std::runtime_error(message);
-    }
-}
+{}
 
 void TimeSpan::update(const TimeStamp & start, const TimeStamp & end) {
     valid = true;
@@ -51,67 +39,82 @@ double TimeSpan::span_sec() const {
     return epicsTimeDiffInSeconds(&end.ts, &start.ts);
 }
 
-bool TimeStamp::operator == ( const TimeStamp & rhs) const {
-    return epicsTimeEqual(&this->ts, &rhs.ts) && this->utag == rhs.utag;
-}
+const size_t TableBuffer::DEFAULT_CAPACITY = 1024u;
 
-bool TimeStamp::operator < ( const TimeStamp & rhs) const {
-    return epicsTimeLessThan(&this->ts, &rhs.ts) || (epicsTimeEqual(&this->ts, &rhs.ts) && this->utag < rhs.utag);
-}
+void TableBuffer::update_timestamps() {
+    if (empty())
+        return;
 
-bool TimeStamp::operator != ( const TimeStamp & rhs) const {
-    return !(*this == rhs);
-}
+    auto seconds_past_epoch = static_cast<const TimeTable::SECONDS_PAST_EPOCH_T*>(columns_[0]->data());
+    auto nanoseconds = static_cast<const TimeTable::NANOSECONDS_T*>(columns_[1]->data());
+    auto pulse_id = static_cast<const TimeTable::PULSE_ID_T*>(columns_[2]->data());
 
-bool TimeStamp::operator <= ( const TimeStamp & rhs) const {
-    return (*this < rhs) || (*this == rhs);
+    size_t n = size();
+    start_ts_ = { { seconds_past_epoch[0], nanoseconds[0] }, pulse_id[0] };
+    end_ts_ = { { seconds_past_epoch[n-1], nanoseconds[n-1] }, pulse_id[n-1] };
 }
 
-bool TimeStamp::operator >= ( const TimeStamp & rhs) const {
-    return !(*this < rhs);
+// Timestamp of a row in a pushed value
+static TimeStamp row_timestamp(const std::vector<pvxs::shared_array<const void>> & columns, size_t row) {
+    return {
+        {
+            static_cast<const TimeTable::SECONDS_PAST_EPOCH_T*>(columns[0].data())[row],
+            static_cast<const TimeTable::NANOSECONDS_T*>(columns[1].data())[row]
+        },
+        static_cast<const TimeTable::PULSE_ID_T*>(columns[2].data())[row]
+    };
 }
 
-bool TimeStamp::operator > ( const TimeStamp & rhs) const {
-    return !(*this <= rhs);
+// Recomputes the pending span after rows were consumed. Called with lock_ held.
+void TableBuffer::update_pending_span() {
+    if (!empty())
+        pending_span_.start = start_ts_;
+    else if (!incoming_.empty())
+        pending_span_.start = row_timestamp(incoming_.front(), 0);
+    else
+        pending_span_.reset();
+
+    if (on_span_)
+        on_span_(pending_span_, pushed_end_);
 }
 
-void TableBuffer::update_timestamps() {
-    if (empty())
+TableBuffer::Cursor::Cursor(const TableBuffer *buf)
+: seconds_(nullptr), nanoseconds_(nullptr), pulse_id_(nullptr), idx_(0), nrows_(buf->size()), ts_()
+{
+    if (nrows_ == 0)
         return;
 
-    const auto & first = buffer_.front();
-
-    const auto start_seconds_past_epoch =
-        first.get_column_as<const TimeTable::SECONDS_PAST_EPOCH_T>(TimeTable::SECONDS_PAST_EPOCH_COL);
-
-    const auto start_nanoseconds =
-        first.get_column_as<const TimeTable::NANOSECONDS_T>(TimeTable::NANOSECONDS_COL);
-
-    start_ts_ = { start_seconds_past_epoch[inner_idx_], start_nanoseconds[inner_idx_] };
-
-    const auto & last = buffer_.back();
-
-    const auto end_seconds_past_epoch =
-        last.get_column_as<const TimeTable::SECONDS_PAST_EPOCH_T>(TimeTable::SECONDS_PAST_EPOCH_COL);
-
-    const auto & end_nanoseconds =
-        last.get_column_as<const TimeTable::NANOSECONDS_T>(TimeTable::NANOSECONDS_COL);
-
-    size_t n = end_seconds_past_epoch.size();
-    end_ts_ = { end_seconds_past_epoch[n-1], end_nanoseconds[n-1] };
+    seconds_ = static_cast<const TimeTable::SECONDS_PAST_EPOCH_T*>(buf->columns_[0]->data());
+    nanoseconds_ = static_cast<const TimeTable::NANOSECONDS_T*>(buf->columns_[1]->data());
+    pulse_id_ = static_cast<const TimeTable::PULSE_ID_T*>(buf->columns_[2]->data());
+    load();
 }
 
-TableBuffer::TableBuffer()
-: type_(), start_ts_(), end_ts_(), buffer_(), inner_idx_(0u)
+TableBuffer::TableBuffer(size_t capacity, SpanFunc on_span)
+: lock_(), incoming_(), closed_(false), type_(), pending_span_(), on_span_(on_span),
+  pushed_end_(TimeSpan::MIN_TS), watch_ts_(), watching_(false), push_stats_(),
+  capacity_(capacity), columns_(), start_ts_(), end_ts_(), dropped_rows_(0)
 {}
 
 bool TableBuffer::initialized() const {
     // We are initialized when we have types for every column
+    Guard G(lock_);
     return type_.get() != 0;
 }
 
 bool TableBuffer::empty() const {
-    return buffer_.empty();
+    return size() == 0;
+}
+
+size_t TableBuffer::size() const {
+    return columns_.empty() ? 0 : columns_[0]->size();
+}
+
+size_t TableBuffer::bytes() const {
+    size_t total = 0;
+    for (const auto & col : columns_)
+        total += col->bytes();
+    return total;
 }
 
 const std::vector<nt::NTTable::ColumnSpec> & TableBuffer::columns() const {
@@ -141,91 +144,188 @@ std::vector<pvxs::shared_array<void>> TableBuffer::allocate_containers(size_t nu
     return result;
 }
 
-void TableBuffer::push(pvxs::Value value) {
-    if (!type_)
-        type_.reset(new TimeTable(value));
+bool TableBuffer::push(pvxs::Value value, bool & watch_reached, TimeStamp *newest) {
+    watch_reached = false;
 
-    buffer_.emplace_back(type_->wrap(value, true));
+    // Only the producer ever sets type_, so it can read it without locking
+    if (!type_) {
+        std::unique_ptr<TimeTable> type(new TimeTable(value));
+        Guard G(lock_);
+        type_ = std::move(type);
+    }
 
-    update_timestamps();
-}
+    // Validate and look up columns outside of the lock. This is the only
+    // time columns are looked up by name.
+    auto wrapped = type_->wrap(value, true);
+
+    Columns columns;
+    columns.reserve(type_->columns.size());
 
-std::pair<size_t, size_t> TableBuffer::consume_each_row_inner(ConsumeFunc f) {
-    size_t outer_idx = 0;
-    size_t inner_idx;
+    for (const auto & col : type_->columns)
+        columns.push_back(wrapped.get_column_as<const void>(col.name));
 
-    for (auto v : buffer_) {
-        auto seconds_past_epoch =
-            v.get_column_as<const TimeTable::SECONDS_PAST_EPOCH_T>(TimeTable::SECONDS_PAST_EPOCH_COL);
+    size_t nrows = columns[0].size();
 
-        auto nanoseconds =
-            v.get_column_as<const TimeTable::NANOSECONDS_T>(TimeTable::NANOSECONDS_COL);
+    // Sparse columns (see TimeTable::SPARSE_ROWS_COL) can't be buffered row by row
+    for (const auto & col : columns) {
+        if (col.size() != nrows)
+            throw std::runtime_error("Can't buffer a table with columns of different lengths");
+    }
 
-        auto pulse_id =
-            v.get_column_as<const TimeTable::PULSE_ID_T>(TimeTable::PULSE_ID_COL);
+    // Empty updates don't change anything
+    if (nrows == 0) {
+        Guard G(lock_);
+        return !closed_;
+    }
 
-        std::vector<pvxs::shared_array<const void>> col_vals;
-        for (auto & col : type_->data_columns) {
-            auto col_val = v.get_column_as<const void>(col.name);
-            col_vals.push_back(col_val);
-        }
+    TimeStamp start = row_timestamp(columns, 0);
+    TimeStamp end = row_timestamp(columns, nrows - 1);
 
-        // Iterate over rows in this Value
-        size_t n = seconds_past_epoch.size();
-        inner_idx = outer_idx == 0 ? inner_idx_ : 0;
-        for (;inner_idx < n; ++inner_idx) {
+    if (newest)
+        *newest = end;
 
-            TimeStamp ts {
-                { seconds_past_epoch[inner_idx], nanoseconds[inner_idx] }, pulse_id[inner_idx]
-            };
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
 
-            bool done = f(ts, col_vals, inner_idx);
+    Guard G(lock_);
 
-            if (done)
-                return std::make_pair(outer_idx, inner_idx);
-        }
+    if (closed_)
+        return false;
+
+    ++push_stats_.updates;
+    push_stats_.rows += nrows;
+    push_stats_.last_push = now;
 
-        ++outer_idx;
+    incoming_.emplace_back(std::move(columns));
+
+    if (!pending_span_.valid)
+        pending_span_ = TimeSpan(start, end);
+    else
+        pending_span_.end = end;
+
+    pushed_end_ = end;
+
+    if (on_span_)
+        on_span_(pending_span_, pushed_end_);
+
+    if (watching_ && pushed_end_ >= watch_ts_) {
+        watching_ = false;
+        watch_reached = true;
     }
 
-    return std::make_pair(outer_idx, 0);
+    return true;
 }
 
-void TableBuffer::consume_each_row(ConsumeFunc f) {
-    size_t outer_idx, inner_idx;
-    std::tie(outer_idx, inner_idx) = consume_each_row_inner(f);
+bool TableBuffer::watch(const TimeStamp & ts) {
+    Guard G(lock_);
 
-    // Remove fully consumed buffers
-    for (size_t idx = 0; idx < outer_idx; ++idx)
-        buffer_.pop_front();
+    watch_ts_ = ts;
+    watching_ = pushed_end_ < ts;
+    return !watching_;
+}
+
+void TableBuffer::close() {
+    Guard G(lock_);
+    closed_ = true;
+    incoming_.clear();
+
+    // A closed buffer no longer takes part in any bounds
+    pending_span_.reset();
+    if (on_span_)
+        on_span_(pending_span_, TimeSpan::MAX_TS);
+}
+
+void TableBuffer::collect() {
+    std::deque<Columns> incoming;
+
+    {
+        Guard G(lock_);
+        incoming.swap(incoming_);
+    }
+
+    if (incoming.empty())
+        return;
+
+    // Anything was pushed, so type_ is set by now
+    if (columns_.empty()) {
+        for (const auto & col : type_->columns)
+            columns_.emplace_back(ColumnBuffer::create(col.type_code.arrayType(), capacity_));
+    }
+
+    // Copy rows into the column buffers. The pushed arrays are released here.
+    for (const auto & columns : incoming) {
+        for (size_t i = 0; i < columns_.size(); ++i)
+            columns_[i]->append(columns[i]);
+    }
 
-    // Remove rows from partially consumed buffers
-    inner_idx_ = inner_idx;
     update_timestamps();
 }
 
+const void * TableBuffer::column_data(size_t idx) const {
+    if (columns_.empty())
+        return nullptr;
+
+    return columns_.at(type_->time_columns.size() + idx)->data();
+}
+
+void TableBuffer::consume(size_t num_rows) {
+    if (num_rows == 0)
+        return;
+
+    for (auto & col : columns_)
+        col->consume(num_rows);
+
+    update_timestamps();
+
+    Guard G(lock_);
+    if (!closed_)
+        update_pending_span();
+}
+
+void TableBuffer::drop(size_t num_rows) {
+    num_rows = std::min(num_rows, size());
+    consume(num_rows);
+    dropped_rows_ += num_rows;
+}
+
+size_t TableBuffer::dropped_rows() const {
+    return dropped_rows_;
+}
+
+TableBuffer::PushStats TableBuffer::push_stats() const {
+    Guard G(lock_);
+    return push_stats_;
+}
+
+void TableBuffer::consume_each_row(ConsumeFunc f) {
+    std::vector<const void *> col_vals;
+    for (size_t idx = 0; idx < data_columns().size(); ++idx)
+        col_vals.push_back(column_data(idx));
+
+    size_t row = 0;
+    for (auto c = cursor(); !c.done(); c.next(), ++row) {
+        if (f(c.timestamp(), col_vals, row))
+            break;
+    }
+
+    consume(row);
+}
+
+TableBuffer::Cursor TableBuffer::cursor() const {
+    return Cursor(this);
+}
+
 size_t TableBuffer::extract_timestamps_between(const TimeStamp & start, const TimeStamp & end,
     std::set<TimeStamp> & timestamps) const
 {
-    if (buffer_.empty())
-        return 0;
-
     size_t processed = 0;
 
-    for (const auto & buf : buffer_) {
-        auto seconds = buf.get_column_as<const TimeTable::SECONDS_PAST_EPOCH_T>(TimeTable::SECONDS_PAST_EPOCH_COL);
-        auto nanoseconds = buf.get_column_as<const TimeTable::NANOSECONDS_T>(TimeTable::NANOSECONDS_COL);
-        auto utag = buf.get_column_as<const TimeTable::PULSE_ID_T>(TimeTable::PULSE_ID_COL);
-
-        size_t nrows = std::min(std::min(seconds.size(), nanoseconds.size()), utag.size());
-
-        for (size_t row = 0; row < nrows; ++row) {
-            TimeStamp ts { { seconds[row], nanoseconds[row] }, utag[row]};
+    for (auto c = cursor(); !c.done(); c.next()) {
+        const auto & ts = c.timestamp();
 
-            if (ts >= start && ts < end) {
-                timestamps.insert(ts);
-                ++processed;
-            }
+        if (ts >= start && ts < end) {
+            timestamps.insert(ts);
+            ++processed;
         }
     }
 
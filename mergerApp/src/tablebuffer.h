@@ -7,11 +7,14 @@
 #include <functional>
 
 #include <epicsTime.h>
+#include <epicsMutex.h>
 
 #include <tab/nttable.h>
 #include <tab/timetable.h>
 #include <pvxs/data.h>
 
+#include "columnbuffer.h"
+
 namespace tabulator {
 
 // Extended timestamp: epicsTimeStamp + user tag
@@ -19,13 +22,27 @@ struct TimeStamp {
     epicsTimeStamp ts;
     uint64_t utag;
 
-    /* comparison operators */
-    bool operator == ( const TimeStamp & ) const;
-    bool operator != ( const TimeStamp & ) const;
-    bool operator <= ( const TimeStamp & ) const;
-    bool operator <  ( const TimeStamp & ) const;
-    bool operator >= ( const TimeStamp & ) const;
-    bool operator >  ( const TimeStamp & ) const;
+    /* comparison operators, inlined since they run for every buffered row.
+     * Equivalent to epicsTimeLessThan/epicsTimeEqual for normalized timestamps
+     */
+    bool operator == ( const TimeStamp & rhs ) const {
+        return ts.secPastEpoch == rhs.ts.secPastEpoch && ts.nsec == rhs.ts.nsec && utag == rhs.utag;
+    }
+
+    bool operator < ( const TimeStamp & rhs ) const {
+        if (ts.secPastEpoch != rhs.ts.secPastEpoch)
+            return ts.secPastEpoch < rhs.ts.secPastEpoch;
+
+        if (ts.nsec != rhs.ts.nsec)
+            return ts.nsec < rhs.ts.nsec;
+
+        return utag < rhs.utag;
+    }
+
+    bool operator != ( const TimeStamp & rhs ) const { return !(*this == rhs); }
+    bool operator <= ( const TimeStamp & rhs ) const { return !(rhs < *this); }
+    bool operator >= ( const TimeStamp & rhs ) const { return !(*this < rhs); }
+    bool operator >  ( const TimeStamp & rhs ) const { return rhs < *this; }
 };
 
 struct TimeSpan {
@@ -48,14 +65,23 @@ struct TimeSpan {
 
 /* TableBuffer
  *
- * Buffers a series of given `pvxs::Value` objects in a FIFO manner.
- * Keeps track of earliest and latest sample timestamp. The `pvxs::Value`
- * is assumed to be an NTTable with a particular format: the first two
- * columns are named "secondsPastEpoch" and "nanoseconds", both containing
- * uint32_t values that compose the parts of an `epicsTimeStamp` for each
- * row. Also, timestamps within an NTTable and from older and newer NTTables
- * are assumed to be strictly non-decreasing.
- * *
+ * Buffers the rows of a series of given `pvxs::Value` objects in a FIFO
+ * manner. Keeps track of earliest and latest sample timestamp. The
+ * `pvxs::Value` is assumed to be an NTTable with a particular format: the
+ * first three columns are named "secondsPastEpoch", "nanoseconds" and
+ * "pulseId", which compose an extended timestamp for each row. Also,
+ * timestamps within an NTTable and from older and newer NTTables are
+ * assumed to be strictly non-decreasing.
+ *
+ * Rows are stored column by column, each column in its own contiguous
+ * typed buffer (see `ColumnBuffer`), so rows can be read with pointer
+ * arithmetic and are released as soon as they are consumed.
+ *
+ * A TableBuffer has a producer side (`push`, `close`), which may be used
+ * by one thread, and a consumer side (everything else), which may be used
+ * by another thread. The two sides only share a short queue of pushed,
+ * not yet collected, values. The consumer side is not synchronized: callers
+ * must ensure it is used by a single thread at a time.
  */
 class TableBuffer {
 
@@ -63,48 +89,138 @@ public:
     typedef std::function<
         bool( /* Returns "done": true to stop iterating early, false to continue iterating.*/
             const TimeStamp &, /* row timestamp */
-            const std::vector<pvxs::shared_array<const void>> & /* column containers */,
-            size_t /* row index within each column container */
+            const std::vector<const void *> & /* data column contents, starting at the oldest row */,
+            size_t /* row index within each column */
         )
     > ConsumeFunc;
 
+    /* Read-only cursor over the buffered rows, oldest first.
+     * A cursor is invalidated by any call that modifies the buffer.
+     */
+    class Cursor {
+    private:
+        const TimeTable::SECONDS_PAST_EPOCH_T *seconds_;
+        const TimeTable::NANOSECONDS_T *nanoseconds_;
+        const TimeTable::PULSE_ID_T *pulse_id_;
+        size_t idx_;
+        size_t nrows_;
+        TimeStamp ts_;
+
+        void load() {
+            if (!done())
+                ts_ = { { seconds_[idx_], nanoseconds_[idx_] }, pulse_id_[idx_] };
+        }
+
+    public:
+        Cursor(const TableBuffer *buf);
+
+        /* True if the cursor moved past the last buffered row */
+        bool done() const {
+            return idx_ >= nrows_;
+        }
+
+        /* Timestamp of the current row. Only meaningful if !done() */
+        const TimeStamp & timestamp() const {
+            return ts_;
+        }
+
+        /* Moves to the next row */
+        void next() {
+            ++idx_;
+            load();
+        }
+    };
+
+    /* Called, under the buffer lock, whenever the span of all rows not yet
+     * consumed (collected or not) or the latest pushed timestamp changes.
+     * Once the buffer is closed, the latest pushed timestamp is reported as
+     * `TimeSpan::MAX_TS`, so it doesn't hold back anyone waiting for it.
+     */
+    typedef std::function<
+        void(
+            const TimeSpan & /* pending rows */,
+            const TimeStamp & /* latest pushed timestamp */
+        )
+    > SpanFunc;
+
+    /* Initial per-column capacity, in rows */
+    static const size_t DEFAULT_CAPACITY;
+
+    /* What was pushed so far */
+    struct PushStats {
+        size_t updates;             // Non-empty updates
+        size_t rows;
+        epicsTimeStamp last_push;   // Wall clock time of the last update (zero if none)
+    };
+
 private:
+    typedef std::vector<pvxs::shared_array<const void>> Columns;
+
+    // Shared between producer and consumer
+    mutable epicsMutex lock_;
+    std::deque<Columns> incoming_;
+    bool closed_;
+
+    // Set once, by the producer, under lock_
     std::unique_ptr<TimeTable> type_;
+
+    // Span of the rows not yet consumed and its observer, under lock_
+    TimeSpan pending_span_;
+    const SpanFunc on_span_;
+
+    // Latest pushed timestamp and watch (see `watch`), under lock_
+    TimeStamp pushed_end_;
+    TimeStamp watch_ts_;
+    bool watching_;
+
+    // Push statistics, under lock_
+    PushStats push_stats_;
+
+    // Consumer side
+    const size_t capacity_;
+    std::vector<std::unique_ptr<ColumnBuffer>> columns_; // Time columns first, then data columns
     TimeStamp start_ts_;
     TimeStamp end_ts_;
-    std::deque<TimeTableValue> buffer_;
-    size_t inner_idx_;
+    size_t dropped_rows_;
 
     void update_timestamps();
-
-    std::pair<size_t, size_t> consume_each_row_inner(ConsumeFunc f);
+    void update_pending_span();
 
 public:
-    /* Constructs an empty TableBuffer */
-    TableBuffer();
+    /* Constructs an empty TableBuffer, whose columns will initially
+     * have room for `capacity` rows. If given, `on_span` is told about
+     * every change in the span of the rows not yet consumed.
+     */
+    TableBuffer(size_t capacity = DEFAULT_CAPACITY, SpanFunc on_span = SpanFunc());
 
     /* A TableBuffer is initialized if at least one sample has been
      * pushed into it (so we know its type)
      */
     bool initialized() const;
 
-    /* A TableBuffer is empty if it holds no samples */
+    /* A TableBuffer is empty if it holds no collected samples */
     bool empty() const;
 
+    /* Number of collected rows */
+    size_t size() const;
+
+    /* Approximate number of bytes held by the collected rows */
+    size_t bytes() const;
+
     /* Returns a list of NTTable::ColumnSpec that can be used to construct
      * a new NTTable. The columns in this list correspond to the columns
-     * of the stored `pvxs::Value`s.
+     * of the pushed `pvxs::Value`s.
      */
     const std::vector<nt::NTTable::ColumnSpec> & columns() const;
 
     /* Returns a list of NTTable::ColumnSpec that can be used to construct
      * a new NTTable. The columns in this list correspond to the columns
-     * of the stored `pvxs::Value`s, skipping the first two (secondsPastEpoch
-     * and nanoseconds).
+     * of the pushed `pvxs::Value`s, skipping the time columns
+     * (secondsPastEpoch, nanoseconds and pulseId).
      */
     const std::vector<nt::NTTable::ColumnSpec> & data_columns() const;
 
-    /* Returns the time span that this buffer covers */
+    /* Returns the time span that the collected rows cover */
     TimeSpan time_span() const;
 
     /* Convenience method that allocates a list of `pvxs::shared_array`s that
@@ -113,10 +229,46 @@ public:
      */
     std::vector<pvxs::shared_array<void>> allocate_containers(size_t num_rows) const;
 
-    /* Pushes a new `pvxs::Value` into the buffer. It will be appended at the
-     * end of the buffer (queue).
+    /* Producer side. Validates and pushes a new `pvxs::Value` into the
+     * buffer. Its rows will be appended at the end of the buffer (queue)
+     * on the next call to `collect`. Returns false if the buffer was closed.
+     * Sets `watch_reached` to true if this push reached the armed watch.
+     * If given, `newest` is set to the timestamp of the last pushed row
+     * (left untouched if there were no rows). Throws if the columns of
+     * `value` don't all have the same number of rows.
      */
-    void push(pvxs::Value value);
+    bool push(pvxs::Value value, bool & watch_reached, TimeStamp *newest = nullptr);
+
+    /* Arms a watch at `ts`: the first push whose rows reach `ts` will
+     * report it. Returns true, without arming, if pushed rows already
+     * reached `ts`. Re-arming replaces the previous watch.
+     */
+    bool watch(const TimeStamp & ts);
+
+    /* Rejects any further pushes */
+    void close();
+
+    /* Moves pushed rows into the column buffers, so they can be consumed */
+    void collect();
+
+    /* Contents of the data column at index `idx` (as in `data_columns()`),
+     * starting at the oldest row. The pointed-to type corresponds to the
+     * column's type code, with `bool` for `BoolA`. Invalidated by any call
+     * that modifies the buffer.
+     */
+    const void * column_data(size_t idx) const;
+
+    /* Removes the `num_rows` oldest rows */
+    void consume(size_t num_rows);
+
+    /* Removes the `num_rows` oldest rows, counting them as dropped */
+    void drop(size_t num_rows);
+
+    /* Total number of rows removed with `drop` */
+    size_t dropped_rows() const;
+
+    /* Safe to call from any thread */
+    PushStats push_stats() const;
 
     /* Executes the given function `f` on each row, starting at the oldest.
      * Keeps calling `f` until it returns `true` or all rows are consumed.
@@ -124,6 +276,9 @@ public:
      */
     void consume_each_row(ConsumeFunc f);
 
+    /* Returns a cursor positioned at the oldest buffered row */
+    Cursor cursor() const;
+
     /* Extracts all timestamps into a set */
     size_t extract_timestamps_between(
         const TimeStamp & start, const TimeStamp & end,
@@ -133,4 +288,4 @@ public:
 
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -2,6 +2,11 @@
 
 #include <vector>
 #include <set>
+#include <memory>
+#include <algorithm>
+#include <limits>
+#include <type_traits>
+#include <cstring>
 #include <cmath>
 #include <exception>
 
@@ -19,6 +24,13 @@ typedef epicsGuard<epicsMutex> Guard;
 
 namespace tabulator {
 
+// Marks a buffer row that doesn't map to any output row
+static const size_t NO_ROW = std::numeric_limits<size_t>::max();
+
+// In pulse id alignment, fall back to timestamp alignment if the pulse ids in
+// a window are spread over more than this many slots per buffered row
+static const size_t MAX_SLOTS_PER_ROW = 16;
+
 TimeBounds::TimeBounds() {
     reset();
 }
@@ -29,8 +41,41 @@ void TimeBounds::reset() {
     earliest_end = TimeSpan::MAX_TS;
     latest_start = TimeSpan::MIN_TS;
     latest_end = TimeSpan::MIN_TS;
+    watermark = TimeSpan::MAX_TS;
+}
+
+void TimeBounds::merge(const TimeSpan & span) {
+    if (!span.valid)
+        return;
+
+    earliest_start = std::min(span.start, earliest_start);
+    earliest_end   = std::min(span.end,   earliest_end);
+    latest_start   = std::max(span.start, latest_start);
+    latest_end     = std::max(span.end,   latest_end);
+    valid = true;
+}
+
+void TimeBounds::merge(const TimeBounds & other) {
+    watermark = std::min(other.watermark, watermark);
+
+    if (!other.valid)
+        return;
+
+    earliest_start = std::min(other.earliest_start, earliest_start);
+    earliest_end   = std::min(other.earliest_end,   earliest_end);
+    latest_start   = std::max(other.latest_start,   latest_start);
+    latest_end     = std::max(other.latest_end,     latest_end);
+    valid = true;
 }
 
+static const nt::NTTable::ColumnSpec VALID {
+    pvxs::TypeCode::BoolA, "valid", "valid"
+};
+
+static const nt::NTTable::ColumnSpec SPARSE_ROWS {
+    pvxs::TypeCode::UInt32A, TimeTable::SPARSE_ROWS_COL, TimeTable::SPARSE_ROWS_COL
+};
+
 nt::NTTable::ColumnSpec TimeAlignedTable::prefixed_colspec(size_t idx, size_t total, const std::string & pvname, const nt::NTTable::ColumnSpec & spec) {
     int width = ceil(log2(total) / log2(16));
     char colprefix_buf[512] = {};
@@ -42,51 +87,219 @@ nt::NTTable::ColumnSpec TimeAlignedTable::prefixed_colspec(size_t idx, size_t to
     };
 }
 
+// Recognizes the output of another merger, published with one valid column per input
+// and no sparse columns: every column is prefixed like "tblNN<col_sep>", labelled like
+// "<pvname><label_sep>", and the columns of each prefix start with its valid column.
+// If so, appends its inputs to leaves and returns true.
+bool TimeAlignedTable::nested_leaves(size_t buffer, const std::vector<nt::NTTable::ColumnSpec> & specs,
+    std::vector<Leaf> & leaves) const
+{
+    auto ends_with = [](const std::string & s, const std::string & suffix) {
+        return s.size() > suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+    };
+
+    auto starts_with = [](const std::string & s, const std::string & prefix) {
+        return s.compare(0, prefix.size(), prefix) == 0;
+    };
+
+    std::vector<Leaf> found;
+    std::string prefix, label_prefix;
+
+    // The output columns of a nested buffer start with its own valid column
+    size_t col = 1;
+
+    for (const auto & spec : specs) {
+        bool valid = spec.type_code == VALID.type_code &&
+            ends_with(spec.name, col_sep_ + VALID.name) && ends_with(spec.label, label_sep_ + VALID.label);
+
+        if (valid) {
+            prefix = spec.name.substr(0, spec.name.size() - VALID.name.size());
+            label_prefix = spec.label.substr(0, spec.label.size() - VALID.label.size());
+            found.push_back({ label_prefix.substr(0, label_prefix.size() - label_sep_.size()), buffer, col, {} });
+        } else if (found.empty() || !starts_with(spec.name, prefix) || !starts_with(spec.label, label_prefix)) {
+            return false;
+        }
+
+        std::string name(spec.name.substr(prefix.size()));
+
+        if (name == TimeTable::SPARSE_ROWS_COL)
+            return false;
+
+        found.back().columns.emplace_back(spec.type_code, name, spec.label.substr(label_prefix.size()));
+        ++col;
+    }
+
+    if (found.empty())
+        return false;
+
+    leaves.insert(leaves.end(), found.begin(), found.end());
+    return true;
+}
+
 void TimeAlignedTable::initialize() {
     Guard G(lock_);
 
     if (type_)
         return;
 
-    static const nt::NTTable::ColumnSpec VALID {
-        pvxs::TypeCode::BoolA, "valid", "valid"
-    };
-
     std::vector<nt::NTTable::ColumnSpec> data_columns;
-    size_t idx = 0;
 
     // Check that all buffers are initialized
     for (const auto & buf : buffers_) {
-        if (!buf.second.initialized())
+        if (!buf.second->initialized())
             return;
     }
 
-    // Build type
+    // Find the inputs to publish, flattening the outputs of other mergers
+    leaves_.clear();
+    nested_.clear();
+
     for (const auto & buf : buffers_) {
-        const auto & pvname = buf.first;
-        data_columns.emplace_back(prefixed_colspec(idx, buffers_.size(), pvname, VALID));
+        const auto & specs = buf.second->data_columns();
+        bool nested = nested_leaves(nested_.size(), specs, leaves_);
+
+        if (nested) {
+            log_info_printf(LOG, "Flattening '%s', the output of another merger\n", buf.first.c_str());
+        } else {
+            Leaf leaf { buf.first, nested_.size(), 0, { VALID } };
+
+            if (sparse_fill_ > 0)
+                leaf.columns.push_back(SPARSE_ROWS);
 
-        for (const auto & spec : buf.second.data_columns())
-            data_columns.emplace_back(prefixed_colspec(idx, buffers_.size(), pvname, spec));
+            leaf.columns.insert(leaf.columns.end(), specs.begin(), specs.end());
+            leaves_.push_back(leaf);
+        }
 
-        ++idx;
+        nested_.push_back(nested);
+    }
+
+    std::stable_sort(leaves_.begin(), leaves_.end(), [](const Leaf & a, const Leaf & b) {
+        return a.pvname < b.pvname;
+    });
+
+    // Build type. Packed validity goes first, one column per group of inputs.
+    if (validity_ == Validity::BITMAP) {
+        size_t num_groups = validity_groups();
+        int width = ceil(log2(num_groups) / log2(16));
+
+        for (size_t group = 0; group < num_groups; ++group) {
+            char suffix[64] = {};
+            epicsSnprintf(suffix, sizeof(suffix), "%0*lu", width, group);
+
+            data_columns.push_back({
+                pvxs::TypeCode::UInt64A,
+                TimeTable::VALIDITY_PREFIX + col_sep_ + suffix,
+                TimeTable::VALIDITY_PREFIX + label_sep_ + suffix
+            });
+        }
+    }
+
+    for (size_t idx = 0; idx < leaves_.size(); ++idx) {
+        const auto & leaf = leaves_[idx];
+
+        // The valid column is left out if validity is packed
+        size_t first = validity_ == Validity::COLUMNS ? 0 : 1;
+
+        for (size_t c = first; c < leaf.columns.size(); ++c)
+            data_columns.emplace_back(prefixed_colspec(idx, leaves_.size(), leaf.pvname, leaf.columns[c]));
     }
 
     type_.reset(new TimeTable(data_columns));
 }
 
+size_t TimeAlignedTable::validity_groups() const {
+    return (leaves_.size() + TimeTable::VALIDITY_BITS - 1) / TimeTable::VALIDITY_BITS;
+}
+
 TimeAlignedTable::TimeAlignedTable(const std::vector<std::string> & pvlist,
-    const std::string & label_sep, const std::string & col_sep)
-: label_sep_(label_sep), col_sep_(col_sep), lock_(), buffers_(), type_()
+    const std::string & label_sep, const std::string & col_sep, size_t num_threads, Alignment alignment,
+    Validity validity)
+: label_sep_(label_sep), col_sep_(col_sep), alignment_(alignment), validity_(validity), inputs_(), lock_(), buffers_(), type_(),
+  pending_(), leaves_(), nested_(), slots_(), cursors_(), heap_(), timestamps_(), row_maps_(), last_rows_(), slot_ts_(), slot_rows_(), cap_timestamps_(), active_(), buffer_columns_(),
+  pool_(new WorkerPool(num_threads)), arena_(), bounds_lock_(), bounds_tree_(), bounds_leaves_(1), bounds_(),
+  slot_bounds_(), slot_active_(), free_slots_(), watch_pending_(0), ready_(), input_budget_(0), total_budget_(0),
+  overflow_policy_(OverflowPolicy::DROP_OLDEST), overflow_stats_(), sparse_fill_(0),
+  latency_lock_(), latency_(), published_(), buffer_published_(), timing_()
 {
-    for (auto pv : pvlist)
-        buffers_[pv] = {};
+    std::set<std::string> names(pvlist.begin(), pvlist.end());
+
+    while (bounds_leaves_ < names.size())
+        bounds_leaves_ *= 2;
+
+    bounds_tree_.resize(2 * bounds_leaves_);
+
+    auto inputs = std::make_shared<Buffers>();
+
+    for (auto & pv : names)
+        (*inputs)[pv] = add_input(pv, true);
+
+    buffers_ = *inputs;
+    inputs_ = inputs;
+
+    log_debug_printf(LOG, "TimeAlignedTable(%lu PVs, %lu threads)\n", pvlist.size(), pool_->size());
+}
+
+// Creates the buffer of a new input, with its own slot in the bounds tree
+std::shared_ptr<TableBuffer> TimeAlignedTable::add_input(const std::string & name, bool active) {
+    size_t slot;
+
+    {
+        Guard G(bounds_lock_);
+
+        // Inputs hold back the watermark until they push something
+        TimeBounds initial;
+        initial.watermark = TimeSpan::MIN_TS;
+
+        if (!free_slots_.empty()) {
+            slot = free_slots_.back();
+            free_slots_.pop_back();
+            slot_bounds_[slot] = initial;
+            slot_active_[slot] = active;
+        } else {
+            slot = slot_bounds_.size();
+            slot_bounds_.push_back(initial);
+            slot_active_.push_back(active);
+        }
+
+        // Out of leaves: double them and rebuild the tree
+        if (slot >= bounds_leaves_) {
+            while (bounds_leaves_ <= slot)
+                bounds_leaves_ *= 2;
+
+            bounds_tree_.assign(2 * bounds_leaves_, TimeBounds());
+
+            for (size_t s = 0; s < slot; ++s) {
+                if (slot_active_[s])
+                    bounds_tree_[bounds_leaves_ + s] = slot_bounds_[s];
+            }
+
+            for (size_t node = bounds_leaves_ - 1; node > 0; --node) {
+                bounds_tree_[node].merge(bounds_tree_[2*node]);
+                bounds_tree_[node].merge(bounds_tree_[2*node + 1]);
+            }
+        }
+
+        update_bounds_tree(slot);
+    }
+
+    slots_[name] = slot;
 
-    log_debug_printf(LOG, "TimeAlignedTable(%lu PVs)\n", pvlist.size());
+    return std::make_shared<TableBuffer>(TableBuffer::DEFAULT_CAPACITY,
+        [this, slot](const TimeSpan & span, const TimeStamp & pushed_end) {
+            update_bounds(slot, span, pushed_end);
+        });
+}
+
+// Rebuilds the type from the current set of buffers
+void TimeAlignedTable::reinitialize() {
+    Guard G(lock_);
+    type_.reset();
+    initialize();
 }
 
-bool TimeAlignedTable::initialized() const {
+bool TimeAlignedTable::initialized() {
     Guard G(lock_);
+    initialize();
     return type_.get() != 0;
 }
 
@@ -96,8 +309,9 @@ size_t TimeAlignedTable::force_initialize() {
     std::set<std::string> bufs_to_remove;
 
     for (auto & buf : buffers_) {
-        if (!buf.second.initialized()) {
+        if (!buf.second->initialized()) {
             bufs_to_remove.insert(buf.first);
+            buf.second->close();
             log_warn_printf(LOG, "Dropping '%s'\n", buf.first.c_str());
         }
     }
@@ -109,99 +323,750 @@ size_t TimeAlignedTable::force_initialize() {
     return buffers_.size();
 }
 
-TimeBounds TimeAlignedTable::get_timebounds() const {
+bool TimeAlignedTable::reconfigure(const std::vector<std::string> & pvlist,
+    std::vector<std::string> & added, std::vector<std::string> & removed)
+{
     Guard G(lock_);
 
-    // Collect timespans
-    std::vector<TimeSpan> timespans;
+    std::set<std::string> names(pvlist.begin(), pvlist.end());
+    auto inputs = std::make_shared<Buffers>(*std::atomic_load(&inputs_));
+    bool changed = false;
+
+    for (auto it = inputs->begin(); it != inputs->end();) {
+        if (names.count(it->first)) {
+            ++it;
+            continue;
+        }
+
+        std::string name(it->first);
+
+        // Closed buffers stop accepting pushes, so the listener can cancel its subscription
+        it->second->close();
+        release_slot(slots_[name]);
+
+        changed = buffers_.erase(name) > 0 || changed;
+        pending_.erase(name);
+        slots_.erase(name);
+        published_.erase(name);
+
+        log_info_printf(LOG, "Removed input '%s'\n", name.c_str());
+        removed.push_back(name);
+        it = inputs->erase(it);
+    }
+
+    for (auto & name : names) {
+        // Inputs dropped by force_initialize() get another chance
+        if (buffers_.count(name) || pending_.count(name))
+            continue;
+
+        auto buf = add_input(name, false);
+        (*inputs)[name] = buf;
+        pending_[name] = buf;
+
+        log_info_printf(LOG, "Added input '%s', waiting for its first update\n", name.c_str());
+        added.push_back(name);
+    }
+
+    std::atomic_store(&inputs_, std::shared_ptr<const Buffers>(inputs));
+
+    if (changed)
+        reinitialize();
+
+    return changed;
+}
+
+bool TimeAlignedTable::activate_inputs(const TimeStamp & from) {
+    Guard G(lock_);
+
+    bool changed = false;
+
+    for (auto it = pending_.begin(); it != pending_.end();) {
+        auto & buf = *it->second;
+
+        if (!buf.initialized()) {
+            ++it;
+            continue;
+        }
+
+        // Rows from before the last extraction can't be merged anymore
+        buf.collect();
+
+        size_t stale = 0;
+        for (auto cursor = buf.cursor(); !cursor.done() && cursor.timestamp() < from; cursor.next())
+            ++stale;
+
+        buf.consume(stale);
+        set_slot_active(slots_[it->first], true);
+        buffers_.insert(*it);
+
+        log_info_printf(LOG, "Input '%s' joined the table (%lu stale rows dropped)\n", it->first.c_str(), stale);
+        it = pending_.erase(it);
+        changed = true;
+    }
+
+    if (changed)
+        reinitialize();
+
+    return changed;
+}
+
+size_t TimeAlignedTable::num_pending_inputs() const {
+    Guard G(lock_);
+    return pending_.size();
+}
+
+void TimeAlignedTable::drop_pending_inputs(std::vector<std::string> & dropped) {
+    Guard G(lock_);
+
+    if (pending_.empty())
+        return;
+
+    auto inputs = std::make_shared<Buffers>(*std::atomic_load(&inputs_));
+
+    for (auto & it : pending_) {
+        const std::string & name = it.first;
+
+        // Closed buffers stop accepting pushes, so the listener can cancel its subscription
+        it.second->close();
+        release_slot(slots_[name]);
+
+        inputs->erase(name);
+        slots_.erase(name);
+        published_.erase(name);
+
+        log_info_printf(LOG, "Dropped input '%s', it got no update in time to join the table\n", name.c_str());
+        dropped.push_back(name);
+    }
+
+    pending_.clear();
+    std::atomic_store(&inputs_, std::shared_ptr<const Buffers>(inputs));
+}
+
+void TimeAlignedTable::set_memory_budget(size_t input_bytes, size_t total_bytes, OverflowPolicy policy) {
+    Guard G(lock_);
+    input_budget_ = input_bytes;
+    total_budget_ = total_bytes;
+    overflow_policy_ = policy;
+}
+
+void TimeAlignedTable::set_sparse_fill(double fill) {
+    Guard G(lock_);
+    sparse_fill_ = fill;
+}
+
+TimeAlignedTable::OverflowStats TimeAlignedTable::get_overflow_stats() const {
+    Guard G(lock_);
+    return overflow_stats_;
+}
+
+TimeAlignedTable::Latency TimeAlignedTable::take_input_latency() {
+    Guard G(latency_lock_);
+    Latency latency = latency_;
+    latency_ = Latency();
+    return latency;
+}
+
+std::vector<TimeAlignedTable::InputStats> TimeAlignedTable::get_input_stats() {
+    Guard G(lock_);
+
+    std::vector<InputStats> stats;
+
+    for (const auto * bufs : { &buffers_, &pending_ }) {
+        for (const auto & buf : *bufs) {
+            // Count rows pushed but not collected yet as buffered
+            buf.second->collect();
+
+            const auto & published = published_[buf.first];
+
+            stats.push_back({
+                buf.first, bufs == &buffers_, buf.second->push_stats(),
+                buf.second->size(), buf.second->bytes(), buf.second->dropped_rows(),
+                published.late, published.valid, published.total
+            });
+        }
+    }
+
+    std::sort(stats.begin(), stats.end(), [](const InputStats & a, const InputStats & b) {
+        return a.name < b.name;
+    });
+
+    return stats;
+}
+
+TimeAlignedTable::ExtractTiming TimeAlignedTable::get_extract_timing() const {
+    Guard G(lock_);
+    return timing_;
+}
+
+ColumnArena::Stats TimeAlignedTable::get_arena_stats() const {
+    return arena_.stats();
+}
+
+// Checks buffered (collected) data against the memory budget. Under DROP_OLDEST, drops
+// rows until within budget. Under FORCE_EXTRACT, returns true if over budget.
+bool TimeAlignedTable::enforce_budget() {
+    if (input_budget_ == 0 && total_budget_ == 0)
+        return false;
+
+    // Rows to drop from buf to get rid of (at least) excess_bytes
+    auto rows_for = [](const TableBuffer & buf, size_t excess_bytes) -> size_t {
+        size_t bytes = buf.bytes();
+        size_t rows = buf.size();
+        if (rows == 0 || bytes == 0)
+            return 0;
+        return std::min(rows, (excess_bytes * rows + bytes - 1) / bytes);
+    };
+
+    auto drop = [this](TableBuffer & buf, const std::string & name, size_t rows) {
+        if (rows == 0)
+            return;
+
+        buf.drop(rows);
+        ++overflow_stats_.drop_oldest;
+        overflow_stats_.dropped_rows += rows;
+
+        log_warn_printf(LOG, "Over memory budget, dropped %lu oldest rows of '%s'\n", rows, name.c_str());
+    };
+
+    bool over = false;
+    size_t total = 0;
+    TableBuffer *largest = nullptr;
+    const std::string *largest_name = nullptr;
+
+    for (auto & buf : buffers_) {
+        size_t bytes = buf.second->bytes();
+
+        if (input_budget_ > 0 && bytes > input_budget_) {
+            if (overflow_policy_ == OverflowPolicy::FORCE_EXTRACT) {
+                over = true;
+            } else {
+                drop(*buf.second, buf.first, rows_for(*buf.second, bytes - input_budget_));
+                bytes = buf.second->bytes();
+            }
+        }
+
+        total += bytes;
+    }
+
+    if (total_budget_ > 0 && total > total_budget_) {
+        if (overflow_policy_ == OverflowPolicy::FORCE_EXTRACT) {
+            over = true;
+        } else {
+            // Take from the largest buffers first. Each round either gets us within
+            // budget or empties one buffer, so this terminates.
+            while (total > total_budget_) {
+                largest = nullptr;
+
+                for (auto & buf : buffers_) {
+                    if (!largest || buf.second->bytes() > largest->bytes()) {
+                        largest = buf.second.get();
+                        largest_name = &buf.first;
+                    }
+                }
+
+                size_t before = largest->bytes();
+                if (before == 0)
+                    break;
+
+                drop(*largest, *largest_name, rows_for(*largest, total - total_budget_));
+                total -= before - largest->bytes();
+            }
+        }
+    }
+
+    if (over) {
+        ++overflow_stats_.force_extract;
+        log_warn_printf(LOG, "Over memory budget, forcing extraction%s\n", "");
+    }
+
+    return over;
+}
+
+bool TimeAlignedTable::check_budget() {
+    // The budget is set before concurrent use, no need to lock to know there's none
+    if (input_budget_ == 0 && total_budget_ == 0)
+        return false;
+
+    Guard G(lock_);
 
     for (const auto & buf : buffers_)
-        timespans.emplace_back(buf.second.time_span());
+        buf.second->collect();
 
-    return TimeBounds(timespans.begin(), timespans.end());
+    return enforce_budget();
+}
+
+// Called by buffers, under their own lock, when the span of their pending rows changes
+void TimeAlignedTable::update_bounds(size_t slot, const TimeSpan & span, const TimeStamp & pushed_end) {
+    Guard G(bounds_lock_);
+
+    auto & leaf = slot_bounds_[slot];
+    leaf.reset();
+    leaf.merge(span);
+    leaf.watermark = pushed_end;
+
+    update_bounds_tree(slot);
+}
+
+void TimeAlignedTable::set_slot_active(size_t slot, bool active) {
+    Guard G(bounds_lock_);
+    slot_active_[slot] = active;
+    update_bounds_tree(slot);
+}
+
+// Frees the slot of a removed input for add_input() to reuse. The input's buffer
+// must be closed already, so it doesn't report bounds to the slot anymore.
+void TimeAlignedTable::release_slot(size_t slot) {
+    Guard G(bounds_lock_);
+    slot_active_[slot] = false;
+    slot_bounds_[slot].reset();
+    update_bounds_tree(slot);
+    free_slots_.push_back(slot);
+}
+
+// Propagates the bounds of a slot up the tree and publishes them. Called under bounds_lock_.
+void TimeAlignedTable::update_bounds_tree(size_t slot) {
+    size_t node = bounds_leaves_ + slot;
+
+    if (slot_active_[slot])
+        bounds_tree_[node] = slot_bounds_[slot];
+    else
+        bounds_tree_[node].reset();
+
+    for (node /= 2; node > 0; node /= 2) {
+        bounds_tree_[node].reset();
+        bounds_tree_[node].merge(bounds_tree_[2*node]);
+        bounds_tree_[node].merge(bounds_tree_[2*node + 1]);
+    }
+
+    bounds_.store(bounds_tree_[1]);
+}
+
+TimeBounds TimeAlignedTable::get_timebounds() const {
+    return bounds_.load();
 }
 
 void TimeAlignedTable::push(const std::string & name, pvxs::Value value) {
     log_debug_printf(LOG, "push(name=%s, value.valid=%d)\n", name.c_str(), value.valid());
 
+    // Push the value to the correct buffer
+    auto inputs = std::atomic_load(&inputs_);
+    auto buf = inputs->find(name);
+
+    if (buf == inputs->end())
+        throw std::out_of_range(std::string("Unknown input: ") + name);
+
+    bool watch_reached;
+    TimeStamp newest = TimeSpan::MIN_TS;
+
+    bool pushed;
+
+    // A bad update only puts its own input out of the table
+    try {
+        pushed = buf->second->push(value, watch_reached, &newest);
+    } catch (std::exception & ex) {
+        buf->second->close();
+        throw std::invalid_argument(ex.what());
+    }
+
+    if (!pushed)
+        throw std::out_of_range(std::string("Dropped input: ") + name);
+
+    // How far behind real time this table arrived
+    if (newest != TimeSpan::MIN_TS) {
+        epicsTimeStamp now;
+        epicsTimeGetCurrent(&now);
+        double latency = epicsTimeDiffInSeconds(&now, &newest.ts);
+
+        Guard G(latency_lock_);
+        ++latency_.count;
+        latency_.total += latency;
+        latency_.max = std::max(latency, latency_.max);
+    }
+
+    // Last buffer to reach the watermark wakes up the consumer
+    if (watch_reached && watch_pending_.fetch_sub(1) == 1)
+        ready_.trigger();
+}
+
+void TimeAlignedTable::watch(const TimeStamp & ts) {
     Guard G(lock_);
 
-    // Push the value to the correct buffer
-    buffers_.at(name).push(value);
+    // Forget about wake-ups for any previous watermark
+    ready_.tryWait();
 
-    // Create type if we don't have it already
-    initialize();
+    // Count every buffer as pending before arming any of them, so
+    // concurrent pushes can't bring the count to zero too early
+    watch_pending_ = buffers_.size() + 1;
+
+    for (auto & buf : buffers_) {
+        if (buf.second->watch(ts))
+            --watch_pending_;
+    }
+
+    if (--watch_pending_ == 0)
+        ready_.trigger();
+}
+
+bool TimeAlignedTable::wait(double timeout) {
+    return ready_.wait(timeout);
 }
 
-static void copy_row(
-    std::vector<pvxs::shared_array<void>> & dest,
-    size_t dest_idx,
-    const std::vector<pvxs::shared_array<const void>> src,
-    size_t src_idx
-) {
-    if (dest.size() != src.size())
-        throw std::logic_error("Can't copy between different sized arrays");
-
-    auto dest_it = dest.begin();
-    auto src_it = src.begin();
-
-    for(; dest_it != dest.end() && src_it != src.end(); ++dest_it, ++src_it) {
-        switch (dest_it->original_type()) {
-            #define CASE_COPY_ELEM(AT, T)\
-                case pvxs::ArrayType::AT:\
-                    *(static_cast<T*>(dest_it->data()) + dest_idx) = *(static_cast<const T*>(src_it->data()) + src_idx); break
-
-            CASE_COPY_ELEM(Bool,    bool);
-            CASE_COPY_ELEM(Int8,    int8_t);
-            CASE_COPY_ELEM(Int16,   int16_t);
-            CASE_COPY_ELEM(Int32,   int32_t);
-            CASE_COPY_ELEM(Int64,   int64_t);
-            CASE_COPY_ELEM(UInt8,   uint8_t);
-            CASE_COPY_ELEM(UInt16,  uint16_t);
-            CASE_COPY_ELEM(UInt32,  uint32_t);
-            CASE_COPY_ELEM(UInt64,  uint64_t);
-            CASE_COPY_ELEM(Float32, float);
-            CASE_COPY_ELEM(Float64, double);
-            CASE_COPY_ELEM(String,  std::string);
-
-            #undef CASE_COPY_ELEM
+void TimeAlignedTable::wake() {
+    ready_.trigger();
+}
+
+// Typed bulk operations on a range of column elements. Plain old data is moved
+// around with memcpy/memset, everything else (i.e. std::string) element-wise.
+template<typename T>
+struct ColumnKernel {
+    static void copy(void *dest, size_t dest_idx, const void *src, size_t src_idx, size_t n) {
+        copy(static_cast<T*>(dest) + dest_idx, static_cast<const T*>(src) + src_idx, n,
+            std::integral_constant<bool, std::is_pod<T>::value>());
+    }
+
+    static void fill(void *dest, size_t dest_idx, size_t n) {
+        fill(static_cast<T*>(dest) + dest_idx, n, std::integral_constant<bool, std::is_pod<T>::value>());
+    }
+
+private:
+    static void copy(T *dest, const T *src, size_t n, std::true_type) {
+        memcpy(dest, src, n * sizeof(T));
+    }
+
+    static void copy(T *dest, const T *src, size_t n, std::false_type) {
+        std::copy(src, src + n, dest);
+    }
+
+    static void fill(T *dest, size_t n, std::true_type) {
+        // All-zero bytes is the value-initialized state of every POD type we handle
+        memset(dest, 0, n * sizeof(T));
+    }
+
+    static void fill(T *dest, size_t n, std::false_type) {
+        std::fill(dest, dest + n, T());
+    }
+};
+
+// Column operations, resolved once per column from its element type
+struct ColumnOps {
+    void (*copy)(void *dest, size_t dest_idx, const void *src, size_t src_idx, size_t n);
+    void (*fill)(void *dest, size_t dest_idx, size_t n);
+
+    ColumnOps(pvxs::ArrayType type) {
+        switch (type) {
+            #define CASE_OPS(AT, T)\
+                case pvxs::ArrayType::AT: copy = &ColumnKernel<T>::copy; fill = &ColumnKernel<T>::fill; break
+
+            CASE_OPS(Bool,    bool);
+            CASE_OPS(Int8,    int8_t);
+            CASE_OPS(Int16,   int16_t);
+            CASE_OPS(Int32,   int32_t);
+            CASE_OPS(Int64,   int64_t);
+            CASE_OPS(UInt8,   uint8_t);
+            CASE_OPS(UInt16,  uint16_t);
+            CASE_OPS(UInt32,  uint32_t);
+            CASE_OPS(UInt64,  uint64_t);
+            CASE_OPS(Float32, float);
+            CASE_OPS(Float64, double);
+            CASE_OPS(String,  std::string);
+
+            #undef CASE_OPS
 
             default:
                 throw std::runtime_error("Don't know how to copy this element type");
         }
     }
+};
+
+// K-way merge of the (already sorted) buffers. Fills timestamps_ with the sorted
+// union of all timestamps in [start, end), and row_maps_[i] with the output row of
+// each leading row of buffer i (NO_ROW for rows that are to be dropped). Each
+// row_maps_[i] covers exactly the rows to be consumed from buffer i.
+void TimeAlignedTable::merge_timestamps(const TimeStamp & start, const TimeStamp & end) {
+    typedef std::pair<TimeStamp, size_t> HeapEntry;
+
+    // Min-heap on timestamp, ties broken by buffer index to keep things deterministic
+    auto later = [](const HeapEntry & a, const HeapEntry & b) {
+        return b.first < a.first || (a.first == b.first && b.second < a.second);
+    };
+
+    cursors_.clear();
+    heap_.clear();
+    timestamps_.clear();
+    row_maps_.resize(buffers_.size());
+    last_rows_.assign(buffers_.size(), NO_ROW);
+
+    size_t buf_idx = 0;
+    for (const auto & buf : buffers_) {
+        auto & row_map = row_maps_[buf_idx];
+        row_map.clear();
+
+        cursors_.emplace_back(buf.second->cursor());
+        auto & cursor = cursors_.back();
+
+        // Rows before the window are consumed, but don't show up in the output
+        for (; !cursor.done() && cursor.timestamp() < start; cursor.next())
+            row_map.push_back(NO_ROW);
+
+        if (!cursor.done() && cursor.timestamp() < end) {
+            heap_.emplace_back(cursor.timestamp(), buf_idx);
+            std::push_heap(heap_.begin(), heap_.end(), later);
+        }
+
+        ++buf_idx;
+    }
+
+    while (!heap_.empty()) {
+        std::pop_heap(heap_.begin(), heap_.end(), later);
+        TimeStamp ts = heap_.back().first;
+        buf_idx = heap_.back().second;
+        heap_.pop_back();
+
+        if (timestamps_.empty() || timestamps_.back() != ts)
+            timestamps_.push_back(ts);
+
+        size_t row = timestamps_.size() - 1;
+        auto & last_row = last_rows_[buf_idx];
+
+        // A repeated timestamp within the same buffer only contributes its first row,
+        // however many times it is repeated
+        if (last_row != NO_ROW && row <= last_row) {
+            row_maps_[buf_idx].push_back(NO_ROW);
+        } else {
+            row_maps_[buf_idx].push_back(row);
+            last_row = row;
+        }
+
+        auto & cursor = cursors_[buf_idx];
+        cursor.next();
+
+        if (!cursor.done() && cursor.timestamp() < end) {
+            heap_.emplace_back(cursor.timestamp(), buf_idx);
+            std::push_heap(heap_.begin(), heap_.end(), later);
+        }
+    }
+
+    // Cursors are invalidated once the buffers are consumed
+    cursors_.clear();
 }
 
-static void set_empty_row(std::vector<pvxs::shared_array<void>> & dest, size_t idx) {
-    for (auto dest_it = dest.begin(); dest_it != dest.end(); ++dest_it) {
-        switch (dest_it->original_type()) {
-            #define CASE_SET_ELEM(AT, T)\
-                case pvxs::ArrayType::AT: *(static_cast<T*>(dest_it->data()) + idx) = {}; break
+// Builds the valid column, the sparse rows column (if sparse_fill > 0) and the data
+// columns of one input buffer, consuming its extracted rows. row_map comes from
+// merge_timestamps(). Data columns only hold the valid rows if less than sparse_fill
+// of the rows are valid, all rows (invalid ones zero filled) otherwise.
+static void assemble_columns(TableBuffer & buf, const std::vector<size_t> & row_map, size_t num_rows,
+    double sparse_fill, ColumnArena & arena, std::vector<pvxs::shared_array<void>> & columns)
+{
+    size_t num_valid = row_map.size() - std::count(row_map.begin(), row_map.end(), NO_ROW);
+    bool sparse = sparse_fill > 0 && num_valid < sparse_fill * num_rows;
+    size_t num_values = sparse ? num_valid : num_rows;
+
+    // These will hold the final extracted values
+    auto valid = arena.allocate<bool>(num_rows);
+    auto sparse_rows = arena.allocate<TimeTable::SPARSE_ROW_T>(sparse ? num_valid : 0);
+
+    std::vector<pvxs::shared_array<void>> column_values;
+    for (const auto & spec : buf.data_columns())
+        column_values.emplace_back(arena.allocate(spec.type_code.arrayType(), num_values));
+
+    // Resolve the element type of each column once
+    std::vector<ColumnOps> ops;
+    for (const auto & col : column_values)
+        ops.emplace_back(col.original_type());
+
+    // Copy runs of matched rows that are contiguous in both the source and the
+    // output, and fill the gaps between them with invalid values (only in the
+    // valid column, if sparse).
+    size_t row = 0;
+    size_t value = 0;
+
+    auto fill_invalid = [&valid, &column_values, &ops, sparse](size_t first, size_t n) {
+        if (n == 0)
+            return;
 
-            CASE_SET_ELEM(Bool,    bool);
-            CASE_SET_ELEM(Int8,    int8_t);
-            CASE_SET_ELEM(Int16,   int16_t);
-            CASE_SET_ELEM(Int32,   int32_t);
-            CASE_SET_ELEM(Int64,   int64_t);
-            CASE_SET_ELEM(UInt8,   uint8_t);
-            CASE_SET_ELEM(UInt16,  uint16_t);
-            CASE_SET_ELEM(UInt32,  uint32_t);
-            CASE_SET_ELEM(UInt64,  uint64_t);
-            CASE_SET_ELEM(Float32, float);
-            CASE_SET_ELEM(Float64, double);
-            CASE_SET_ELEM(String,  std::string);
+        std::fill(valid.begin() + first, valid.begin() + first + n, false);
 
-            #undef CASE_SET_ELEM
+        if (sparse)
+            return;
 
-            default:
-                throw std::runtime_error("Don't know how to set this element type");
+        for (size_t c = 0; c < column_values.size(); ++c)
+            ops[c].fill(column_values[c].data(), first, n);
+    };
+
+    std::vector<const void *> buf_cols;
+    for (size_t c = 0; c < column_values.size(); ++c)
+        buf_cols.push_back(buf.column_data(c));
+
+    size_t src_rows = row_map.size();
+    size_t i = 0;
+    while (i < src_rows) {
+        size_t dest_row = row_map[i];
+
+        // Rows before the window or with a repeated timestamp are dropped
+        if (dest_row == NO_ROW) {
+            ++i;
+            continue;
+        }
+
+        // Extend the run for as long as source and output rows are both consecutive
+        size_t n = 1;
+        while (i + n < src_rows && row_map[i + n] == dest_row + n)
+            ++n;
+
+        // Output rows must rise along the buffer's rows
+        if (dest_row < row)
+            throw std::logic_error("assemble_columns(): output rows out of order");
+
+        fill_invalid(row, dest_row - row);
+
+        std::fill(valid.begin() + dest_row, valid.begin() + dest_row + n, true);
+
+        if (sparse) {
+            for (size_t j = 0; j < n; ++j)
+                sparse_rows[value + j] = dest_row + j;
+        } else {
+            value = dest_row;
+        }
+
+        for (size_t c = 0; c < column_values.size(); ++c)
+            ops[c].copy(column_values[c].data(), value, buf_cols[c], i, n);
+
+        row = dest_row + n;
+        value += n;
+        i += n;
+    }
+
+    buf.consume(src_rows);
+
+    // The remaining rows are invalid
+    fill_invalid(row, num_rows - row);
+
+    // We built all columns from this buffer, save them
+    columns.emplace_back(valid.castTo<void>());
+
+    if (sparse_fill > 0)
+        columns.emplace_back(sparse_rows.castTo<void>());
+
+    columns.insert(columns.end(), column_values.begin(), column_values.end());
+
+    log_debug_printf(LOG, "extract() - generated %lu data columns (%s)\n", columns.size(),
+        sparse ? "sparse" : "dense");
+}
+
+// Pulse id alignment. Fills timestamps_ and row_maps_ like merge_timestamps() does,
+// but matches rows by pulse id: rows are placed in a direct-indexed array of slots,
+// keyed by (pulse id - smallest pulse id in the window), so no sorting or timestamp
+// comparisons are needed to join them. Each output row takes the timestamp of the
+// first buffer with a row in its slot.
+// Returns false, without consuming anything, if the pulse ids in the window are too
+// spread out to be indexed directly.
+bool TimeAlignedTable::merge_pulse_ids(const TimeStamp & start, const TimeStamp & end) {
+    timestamps_.clear();
+    row_maps_.resize(buffers_.size());
+
+    // First pass: find which rows are in the window, and the range of their pulse ids.
+    // row_maps_ temporarily holds the pulse id of each row in the window.
+    TimeTable::PULSE_ID_T min_pulse_id = std::numeric_limits<TimeTable::PULSE_ID_T>::max();
+    TimeTable::PULSE_ID_T max_pulse_id = 0;
+    size_t total_rows = 0;
+
+    size_t buf_idx = 0;
+    for (const auto & buf : buffers_) {
+        auto & row_map = row_maps_[buf_idx++];
+        row_map.clear();
+
+        auto cursor = buf.second->cursor();
+
+        // Rows before the window are consumed, but don't show up in the output
+        for (; !cursor.done() && cursor.timestamp() < start; cursor.next())
+            row_map.push_back(NO_ROW);
+
+        for (; !cursor.done() && cursor.timestamp() < end; cursor.next()) {
+            TimeTable::PULSE_ID_T pulse_id = cursor.timestamp().utag;
+            min_pulse_id = std::min(min_pulse_id, pulse_id);
+            max_pulse_id = std::max(max_pulse_id, pulse_id);
+            row_map.push_back(pulse_id);
+            ++total_rows;
+        }
+    }
+
+    if (total_rows == 0)
+        return true;
+
+    size_t num_slots = max_pulse_id - min_pulse_id + 1;
+
+    if (max_pulse_id - min_pulse_id >= total_rows * MAX_SLOTS_PER_ROW) {
+        log_warn_printf(LOG, "Pulse ids %lu..%lu are too sparse for %lu rows, aligning by timestamp\n",
+            min_pulse_id, max_pulse_id, total_rows);
+        return false;
+    }
+
+    slot_ts_.resize(num_slots);
+    slot_rows_.assign(num_slots, NO_ROW);
+
+    // Second pass: mark occupied slots (temporarily with a non-NO_ROW value),
+    // remembering the timestamp of each
+    buf_idx = 0;
+    for (const auto & buf : buffers_) {
+        auto & row_map = row_maps_[buf_idx++];
+        auto cursor = buf.second->cursor();
+        size_t last_slot = NO_ROW;  // Highest slot taken from this buffer
+
+        for (auto & entry : row_map) {
+            if (entry != NO_ROW) {
+                size_t slot = entry - min_pulse_id;
+
+                // Output rows must follow the order of the buffer's rows, so a pulse id that
+                // isn't above all the ones taken before it (repeated, or gone backwards after
+                // a reset or wrap) is dropped
+                if (last_slot != NO_ROW && slot <= last_slot) {
+                    entry = NO_ROW;
+                } else {
+                    if (slot_rows_[slot] == NO_ROW) {
+                        slot_rows_[slot] = 0;
+                        slot_ts_[slot] = cursor.timestamp();
+                    }
+
+                    entry = slot;
+                    last_slot = slot;
+                }
+            }
+            cursor.next();
+        }
+    }
+
+    // Number the occupied slots, in order, to get the output rows
+    for (size_t slot = 0; slot < num_slots; ++slot) {
+        if (slot_rows_[slot] == NO_ROW)
+            continue;
+
+        slot_rows_[slot] = timestamps_.size();
+        timestamps_.push_back(slot_ts_[slot]);
+    }
+
+    // Last pass: slots to output rows
+    for (auto & row_map : row_maps_) {
+        for (auto & entry : row_map) {
+            if (entry != NO_ROW)
+                entry = slot_rows_[entry];
         }
     }
+
+    return true;
 }
 
-pvxs::Value TimeAlignedTable::extract(const TimeStamp & start_ts, const TimeStamp & end_ts) {
+pvxs::Value TimeAlignedTable::extract(const TimeStamp & start_ts, const TimeStamp & window_end_ts,
+    size_t max_rows, TimeStamp *extracted_end_ts)
+{
+    epicsTimeStamp lock_start, merge_start, copy_start, copy_end;
+    epicsTimeGetCurrent(&lock_start);
+
     Guard G(lock_);
 
+    epicsTimeGetCurrent(&merge_start);
+
+    TimeStamp end_ts = window_end_ts;
+
     // Sanity check
     if (start_ts > end_ts) {
         char message[1024];
@@ -212,13 +1077,45 @@ pvxs::Value TimeAlignedTable::extract(const TimeStamp & start_ts, const TimeStam
         throw std::runtime_error(message);
     }
 
-    // Sorted unique timestamps
-    std::set<TimeStamp> timestamps;
+    // Take in everything pushed so far
+    for (auto & buf : buffers_)
+        buf.second->collect();
 
-    for (const auto & buf : buffers_)
-        buf.second.extract_timestamps_between(start_ts, end_ts, timestamps);
+    // Output column storage left unused since the previous extraction can go
+    arena_.next_generation();
+
+    // Sorted unique timestamps, and where each buffer row lands in them
+    bool by_pulse_id = alignment_ == Alignment::PULSE_ID && merge_pulse_ids(start_ts, end_ts);
+    if (!by_pulse_id)
+        merge_timestamps(start_ts, end_ts);
 
-    size_t num_rows = timestamps.size();
+    // Too many rows: pull the end of the window back to the first row that doesn't fit
+    // and merge again. The rows left out stay buffered for the next extraction.
+    if (max_rows > 0 && timestamps_.size() > max_rows) {
+        TimeStamp cutoff = timestamps_[max_rows];
+
+        // Rows matched by pulse id are in pulse id order, which needn't be time order
+        if (by_pulse_id) {
+            cap_timestamps_.assign(timestamps_.begin(), timestamps_.end());
+            std::nth_element(cap_timestamps_.begin(), cap_timestamps_.begin() + max_rows, cap_timestamps_.end());
+            cutoff = cap_timestamps_[max_rows];
+        }
+
+        if (cutoff > start_ts) {
+            log_debug_printf(LOG, "extract() - capping %lu rows to %lu\n", timestamps_.size(), max_rows);
+            end_ts = cutoff;
+
+            if (alignment_ != Alignment::PULSE_ID || !merge_pulse_ids(start_ts, end_ts))
+                merge_timestamps(start_ts, end_ts);
+        }
+    }
+
+    if (extracted_end_ts)
+        *extracted_end_ts = end_ts;
+
+    size_t num_rows = timestamps_.size();
+
+    epicsTimeGetCurrent(&copy_start);
 
     log_debug_printf(LOG, "extract(start=%u.%09u.%016lX, end=%u.%09u.%016lX) --> %lu rows\n",
         start_ts.ts.secPastEpoch, start_ts.ts.nsec, start_ts.utag,
@@ -232,16 +1129,14 @@ pvxs::Value TimeAlignedTable::extract(const TimeStamp & start_ts, const TimeStam
 
     // Generate timestamp arrays
     {
-        pvxs::shared_array<uint32_t> secondsPastEpoch(num_rows);
-        pvxs::shared_array<uint32_t> nanoseconds(num_rows);
-        pvxs::shared_array<uint64_t> userTags(num_rows);
-
-        size_t i = 0;
-        for (const auto & ts : timestamps) {
-            secondsPastEpoch[i] = ts.ts.secPastEpoch;
-            nanoseconds[i] = ts.ts.nsec;
-            userTags[i] = ts.utag;
-            ++i;
+        auto secondsPastEpoch = arena_.allocate<uint32_t>(num_rows);
+        auto nanoseconds = arena_.allocate<uint32_t>(num_rows);
+        auto userTags = arena_.allocate<uint64_t>(num_rows);
+
+        for (size_t i = 0; i < num_rows; ++i) {
+            secondsPastEpoch[i] = timestamps_[i].ts.secPastEpoch;
+            nanoseconds[i] = timestamps_[i].ts.nsec;
+            userTags[i] = timestamps_[i].utag;
         }
 
         // Add timestamps to output columns
@@ -250,63 +1145,78 @@ pvxs::Value TimeAlignedTable::extract(const TimeStamp & start_ts, const TimeStam
         time_columns.emplace_back(userTags.castTo<void>());
     }
 
-    // Extract values from each of our buffers (each buffer contains updates for a single input Table PV)
-    for (auto & buf : buffers_) {
-        // These will hold the final extracted values
-        pvxs::shared_array<bool> valid(num_rows);
-        auto column_values = buf.second.allocate_containers(num_rows);
-
-        // Iterate over each result row
-        size_t row = 0;
-        auto row_ts_it = timestamps.begin();
-
-        buf.second.consume_each_row([this, num_rows, &row, &row_ts_it, start_ts, end_ts, &valid, &column_values](
-            const TimeStamp & buf_row_ts,
-            const std::vector<pvxs::shared_array<const void>> & buf_cols,
-            size_t buf_idx
-        ) -> bool {
-            TimeStamp row_ts = *row_ts_it;
-
-            // Check if we are past the end, stop if we are
-            if (row >= num_rows || buf_row_ts > end_ts)
-                return true;
-
-            // If timestamps are equal, values are valid
-            if (buf_row_ts == row_ts) {
-                valid[row] = true;
-                copy_row(column_values, row, buf_cols, buf_idx);
-                ++row;
-                ++row_ts_it;
-                return false;
-            }
+    // Extract values from each of our buffers (each buffer contains updates for a single input Table PV).
+    // Buffers are independent of each other, so their columns are built in parallel.
+    active_.clear();
+    for (auto & buf : buffers_)
+        active_.push_back(buf.second.get());
 
-            // If the buffer is ahead of us (in time), it means there are missing values.
-            // Skip this iteration (by filling in invalid values)
-            if (buf_row_ts > row_ts) {
-                valid[row] = false;
-                set_empty_row(column_values, row);
-                return false;
-            }
+    buffer_columns_.resize(active_.size());
+    buffer_published_.resize(active_.size());
 
-            // If we got here, it means the buffer is behind us (in time).
-            // Skip this iteration (do nothing)
-            ++row;
-            ++row_ts_it;
-            return false;
+    pool_->parallel_for(active_.size(), [this, num_rows](size_t buf_idx) {
+        const auto & row_map = row_maps_[buf_idx];
+
+        // Rows before the window come first in the row map
+        auto & published = buffer_published_[buf_idx];
+        published.late = std::find_if(row_map.begin(), row_map.end(), [](size_t row) { return row != NO_ROW; }) - row_map.begin();
+        published.valid = row_map.size() - std::count(row_map.begin(), row_map.end(), NO_ROW);
+        published.total = num_rows;
+
+        // The valid columns of the inputs of another merger are all dense
+        assemble_columns(*active_[buf_idx], row_map, num_rows, nested_[buf_idx] ? 0.0 : sparse_fill_,
+            arena_, buffer_columns_[buf_idx]);
+    });
+
+    size_t buf_idx = 0;
+    for (const auto & buf : buffers_) {
+        auto & published = published_[buf.first];
+        published.late += buffer_published_[buf_idx].late;
+        published.valid += buffer_published_[buf_idx].valid;
+        published.total += buffer_published_[buf_idx].total;
+        ++buf_idx;
+    }
+
+    // Pack the valid column of each input into bitmaps, one per group of inputs
+    if (validity_ == Validity::BITMAP) {
+        std::vector<pvxs::shared_array<TimeTable::VALIDITY_T>> masks;
+        for (size_t group = 0; group < validity_groups(); ++group)
+            masks.emplace_back(arena_.allocate<TimeTable::VALIDITY_T>(num_rows));
+
+        pool_->parallel_for(masks.size(), [this, &masks, num_rows](size_t group) {
+            auto mask = masks[group].data();
+            std::fill(mask, mask + num_rows, 0);
+
+            size_t first = group * TimeTable::VALIDITY_BITS;
+            size_t last = std::min(first + TimeTable::VALIDITY_BITS, leaves_.size());
+
+            for (size_t idx = first; idx < last; ++idx) {
+                const auto & leaf = leaves_[idx];
+                auto valid = static_cast<const bool*>(buffer_columns_[leaf.buffer][leaf.first].data());
+                TimeTable::VALIDITY_T bit = TimeTable::VALIDITY_T(1) << (idx - first);
+
+                for (size_t row = 0; row < num_rows; ++row)
+                    if (valid[row])
+                        mask[row] |= bit;
+            }
         });
 
-        // The remaining rows are invalid
-        for (; row < num_rows; ++row) {
-            valid[row] = false;
-            set_empty_row(column_values, row);
-        }
+        for (auto & mask : masks)
+            data_columns.emplace_back(mask.castTo<void>());
+    }
+
+    // Stitch them together, one input at a time, in order
+    size_t first_column = validity_ == Validity::BITMAP ? 1 : 0;
 
-        // We built all columns from this buffer, save them
-        log_debug_printf(LOG, "extract() - generated %lu data columns\n", column_values.size() + 1);
-        data_columns.emplace_back(valid.castTo<void>());
-        data_columns.insert(data_columns.end(), column_values.begin(), column_values.end());
+    for (const auto & leaf : leaves_) {
+        auto & columns = buffer_columns_[leaf.buffer];
+        data_columns.insert(data_columns.end(), columns.begin() + leaf.first + first_column,
+            columns.begin() + leaf.first + leaf.columns.size());
     }
 
+    for (auto & columns : buffer_columns_)
+        columns.clear();
+
     log_debug_printf(LOG, "extract() - generated %lu timestamp columns\n", time_columns.size());
     output_columns.insert(output_columns.end(), time_columns.begin(), time_columns.end());
     output_columns.insert(output_columns.end(), data_columns.begin(), data_columns.end());
@@ -328,6 +1238,11 @@ pvxs::Value TimeAlignedTable::extract(const TimeStamp & start_ts, const TimeStam
     for (; cs != type_->columns.end(); ++cs, ++oc)
         output_value.set_column(cs->name, (*oc).freeze());
 
+    epicsTimeGetCurrent(&copy_end);
+    timing_.lock_wait = epicsTimeDiffInSeconds(&merge_start, &lock_start);
+    timing_.merge = epicsTimeDiffInSeconds(&copy_start, &merge_start);
+    timing_.copy = epicsTimeDiffInSeconds(&copy_end, &copy_start);
+
     log_debug_printf(LOG, "extract() - generated complete value%s\n", "");
 
     return output_value.get();
@@ -335,7 +1250,7 @@ pvxs::Value TimeAlignedTable::extract(const TimeStamp & start_ts, const TimeStam
 
 pvxs::Value TimeAlignedTable::create() const {
     Guard G(lock_);
-    if (initialized())
+    if (type_)
         return type_->create().get();
 
     return {};
@@ -3,13 +3,18 @@
 
 #include <map>
 #include <vector>
+#include <atomic>
 
 #include <epicsTime.h>
 #include <epicsMutex.h>
+#include <epicsEvent.h>
 
 #include <pvxs/data.h>
 
+#include "columnarena.h"
+#include "seqlock.h"
 #include "tablebuffer.h"
+#include <tab/workerpool.h>
 
 namespace tabulator {
 
@@ -20,66 +25,288 @@ struct TimeBounds {
     TimeStamp latest_start;
     TimeStamp latest_end;
 
+    // Oldest of the latest pushed timestamps of all live inputs, whether
+    // they have pending rows or not. No more rows at or before it can be
+    // expected. Tracked even if !valid.
+    TimeStamp watermark;
+
     TimeBounds();
 
-    template<typename I>
-    TimeBounds(const I & begin, const I & end) {
-        reset();
+    void reset();
 
-        if (begin == end)
-            return;
+    // Widens these bounds to include a span or other bounds. Invalid ones are ignored.
+    void merge(const TimeSpan & span);
+    void merge(const TimeBounds & other);
+};
 
-        for (I it = begin; it != end; ++it) {
-            if (!it->valid)
-                continue;
+class TimeAlignedTable {
 
-            earliest_start = std::min(it->start, earliest_start);
-            earliest_end   = std::min(it->end,   earliest_end);
-            latest_start   = std::max(it->start, latest_start);
-            latest_end     = std::max(it->end,   latest_end);
+public:
+    // How rows from different inputs are matched
+    enum class Alignment {
+        TIMESTAMP,  // Same timestamp (seconds, nanoseconds and pulse id)
+        PULSE_ID,   // Same pulse id, regardless of the rest of the timestamp
+    };
 
-            valid = true;
-        }
-    }
+    // How the validity of each input's rows is published
+    enum class Validity {
+        COLUMNS,    // One bool column per input
+        BITMAP,     // Packed bits, one UInt64 column per group of 64 inputs (see TimeTable::VALIDITY_PREFIX)
+    };
 
-    void reset();
-};
+    // What to do when buffered data exceeds the memory budget
+    enum class OverflowPolicy {
+        DROP_OLDEST,    // Drop the oldest rows of the largest buffers until within budget
+        FORCE_EXTRACT,  // Extract without waiting for laggards, which will be marked invalid
+    };
 
-class TimeAlignedTable {
+    // How far behind real time input tables arrive: time between the
+    // newest row of a table and its push
+    struct Latency {
+        size_t count;   // Number of tables
+        double total;   // Sum, in seconds
+        double max;     // Maximum, in seconds
+    };
+
+    // Statistics of an input, totals since it was added
+    struct InputStats {
+        std::string name;
+        bool active;            // False while waiting for its first update (see reconfigure())
+        TableBuffer::PushStats pushed;
+        size_t buffered_rows;   // Rows waiting to be extracted
+        size_t buffered_bytes;
+        size_t dropped_rows;    // Rows dropped to stay within the memory budget
+        size_t late_rows;       // Rows that arrived after their time was published
+        size_t valid_rows;      // Rows published as valid
+        size_t table_rows;      // Rows of all tables published since the input joined
+    };
+
+    // How long the stages of an extraction took, in seconds
+    struct ExtractTiming {
+        double lock_wait;   // Waiting for pushes and other calls to release the table
+        double merge;       // Building the union of all timestamps
+        double copy;        // Building the output columns
+    };
+
+    // How many times each overflow policy fired
+    struct OverflowStats {
+        size_t drop_oldest;     // Number of times rows were dropped
+        size_t dropped_rows;    // Total number of rows dropped
+        size_t force_extract;   // Number of times an early extraction was requested
+    };
 
 private:
     const std::string label_sep_;
     const std::string col_sep_;
+    const Alignment alignment_;
+    const Validity validity_;
+
+    typedef std::map<std::string, std::shared_ptr<TableBuffer>> Buffers;
 
+    // All inputs, by name. Never modified once published, a reconfiguration
+    // publishes a new map, so pushes can look up their buffer without locking
+    // (see std::atomic_load).
+    std::shared_ptr<const Buffers> inputs_;
+
+    // Consumer side: guards the set of active buffers and everything below.
+    // Pushes don't take this lock, they only synchronize with their own buffer.
     mutable epicsMutex lock_;
-    std::map<std::string, TableBuffer> buffers_;
+    Buffers buffers_;
     std::unique_ptr<TimeTable> type_;
 
+    // Inputs added by reconfigure(), waiting for their first update to join buffers_
+    Buffers pending_;
+
+    // An input of the merged table, as published: an input buffer, or one of the inputs
+    // of another merger if a buffer holds its output (see nested_leaves()). Sorted by name,
+    // so a merger tree publishes the same columns as a flat merger.
+    struct Leaf {
+        std::string pvname;
+        size_t buffer;  // Index of its buffer in buffers_
+        size_t first;   // Index of its valid column in the output columns of its buffer
+        std::vector<nt::NTTable::ColumnSpec> columns;   // Unprefixed, valid column first
+    };
+    std::vector<Leaf> leaves_;
+
+    // Whether each buffer holds the output of another merger
+    std::vector<bool> nested_;
+
+    // Bounds tree slot of each input
+    std::map<std::string, size_t> slots_;
+
+    // Scratch space for extract(), kept around so steady-state
+    // extraction doesn't allocate per row
+    std::vector<TableBuffer::Cursor> cursors_;
+    std::vector<std::pair<TimeStamp, size_t>> heap_;
+    std::vector<TimeStamp> timestamps_;
+    std::vector<std::vector<size_t>> row_maps_;
+    std::vector<size_t> last_rows_;
+    std::vector<TimeStamp> slot_ts_;
+    std::vector<size_t> slot_rows_;
+    std::vector<TimeStamp> cap_timestamps_;
+    std::vector<TableBuffer*> active_;
+    std::vector<std::vector<pvxs::shared_array<void>>> buffer_columns_;
+
+    // Builds the columns of different buffers in parallel
+    std::unique_ptr<WorkerPool> pool_;
+
+    // Recycles the storage of posted output columns
+    ColumnArena arena_;
+
+    // Bounds of all pushed, not yet consumed, rows. Kept in a segment tree with
+    // one leaf per input, updated by pushes and consumes in O(log(#inputs)), and
+    // published for lock-free reads.
+    epicsMutex bounds_lock_;
+    std::vector<TimeBounds> bounds_tree_;
+    size_t bounds_leaves_;
+    SeqLock<TimeBounds> bounds_;
+
+    // Latest bounds reported by each slot, and whether they count. Pending
+    // and removed inputs don't.
+    std::vector<TimeBounds> slot_bounds_;
+    std::vector<bool> slot_active_;
+
+    // Slots of removed inputs, handed out again to new ones so the tree doesn't
+    // grow with every reload
+    std::vector<size_t> free_slots_;
+
+    // Watermark: number of active buffers whose pushed data hasn't reached the
+    // watched timestamp yet. Decremented by pushes, ready_ is signalled at zero.
+    std::atomic<long> watch_pending_;
+    epicsEvent ready_;
+
+    // Memory budget, in bytes (0: unlimited)
+    size_t input_budget_;
+    size_t total_budget_;
+    OverflowPolicy overflow_policy_;
+    OverflowStats overflow_stats_;
+
+    // Inputs with less than this fraction of valid rows in a table are
+    // published sparsely (0: always dense)
+    double sparse_fill_;
+
+    // Input latency since the last call to take_input_latency()
+    epicsMutex latency_lock_;
+    Latency latency_;
+
+    // Late, valid and total published rows, by input
+    struct PublishedRows {
+        size_t late;
+        size_t valid;
+        size_t total;
+    };
+    std::map<std::string, PublishedRows> published_;
+    std::vector<PublishedRows> buffer_published_;
+
+    // Stage timings of the last extraction
+    ExtractTiming timing_;
+
+    bool enforce_budget();
+    std::shared_ptr<TableBuffer> add_input(const std::string & name, bool active);
+    void update_bounds(size_t slot, const TimeSpan & span, const TimeStamp & pushed_end);
+    void set_slot_active(size_t slot, bool active);
+    void release_slot(size_t slot);
+    void update_bounds_tree(size_t slot);
+
     void initialize();
+    void reinitialize();
+    bool nested_leaves(size_t buffer, const std::vector<nt::NTTable::ColumnSpec> & specs,
+        std::vector<Leaf> & leaves) const;
+    size_t validity_groups() const;
+    void merge_timestamps(const TimeStamp & start, const TimeStamp & end);
+    bool merge_pulse_ids(const TimeStamp & start, const TimeStamp & end);
     nt::NTTable::ColumnSpec prefixed_colspec(size_t idx, size_t total, const std::string & pvname,
         const nt::NTTable::ColumnSpec & spec);
 
 public:
+    // num_threads: how many threads (including the caller's) build output columns during extract()
     TimeAlignedTable(const std::vector<std::string> & pvlist,
-        const std::string & label_sep, const std::string & col_sep);
+        const std::string & label_sep, const std::string & col_sep, size_t num_threads = 1,
+        Alignment alignment = Alignment::TIMESTAMP, Validity validity = Validity::COLUMNS);
 
     // Returns true if all inner buffers were initialized (got at least 1 update),
-    // false otherwise
-    bool initialized() const;
+    // false otherwise. Builds the table type as soon as that happens.
+    bool initialized();
 
     // Forces this table to be initialized with whatever buffers are available
     // Internal buffers that are not initialized by the time this is called will be dropped.
     // Returns the number of remaining internal buffers
     size_t force_initialize();
 
+    // Replaces the inputs with the ones in pvlist. Inputs not in pvlist are dropped right
+    // away, with all their buffered rows. New inputs are buffered from now on, but only join
+    // the table once they get their first update (see activate_inputs()). The names of the
+    // added and removed inputs are stored in added and removed. Returns true if the table
+    // type changed. Only meant to be called once the table is initialized.
+    bool reconfigure(const std::vector<std::string> & pvlist,
+        std::vector<std::string> & added, std::vector<std::string> & removed);
+
+    // Makes the inputs added by reconfigure() that got their first update part of the
+    // table. Their rows before `from` are dropped. Returns true if the table type changed.
+    bool activate_inputs(const TimeStamp & from);
+
+    // Number of inputs added by reconfigure() still waiting for their first update
+    size_t num_pending_inputs() const;
+
+    // Drops the inputs added by reconfigure() that are still waiting for their first
+    // update, storing their names in dropped. Doesn't change the table type.
+    void drop_pending_inputs(std::vector<std::string> & dropped);
+
+    // Limits how much data may be buffered, per input and in total (in bytes, 0 means unlimited),
+    // and what to do when the limits are exceeded. Enforced on every call to check_budget().
+    // Must be called before the table is used by other threads.
+    void set_memory_budget(size_t input_bytes, size_t total_bytes, OverflowPolicy policy);
+
+    // Publishes the columns of an input sparsely (see TimeTable::SPARSE_ROWS_COL) in the tables
+    // where less than `fill` of the rows are valid for it. Decided per input, per table. If 0,
+    // all inputs are always dense. Must be called before the table is initialized.
+    void set_sparse_fill(double fill);
+
+    // Applies the overflow policy if buffered data exceeds the memory budget. Returns
+    // true if an extraction should happen right away (FORCE_EXTRACT).
+    bool check_budget();
+
+    OverflowStats get_overflow_stats() const;
+
+    // Input latency since the previous call
+    Latency take_input_latency();
+
+    // Statistics of all inputs, including the ones waiting for their first update
+    std::vector<InputStats> get_input_stats();
+
+    // Stage timings of the last extraction
+    ExtractTiming get_extract_timing() const;
+
+    // How output columns were allocated so far
+    ColumnArena::Stats get_arena_stats() const;
+
+    // Bounds of all pushed rows that weren't extracted yet. Doesn't lock or allocate.
     TimeBounds get_timebounds() const;
 
-    // Push a new update to one of the buffers
-    // Throws std::out_of_range if name is not part of this table
+    // Arms the watermark at ts: wait() returns as soon as every active buffer
+    // received data up to ts (and possibly earlier). Re-arming replaces the
+    // previous watermark.
+    void watch(const TimeStamp & ts);
+
+    // Blocks until the armed watermark is reached, wake() is called or
+    // timeout seconds elapse. Returns false on timeout.
+    bool wait(double timeout);
+
+    // Wakes up a thread blocked in wait()
+    void wake();
+
+    // Push a new update to one of the buffers. Safe to call concurrently with
+    // any other method, as long as each buffer is only pushed to by one thread.
+    // Throws std::out_of_range if name is not part of this table (or was dropped), and
+    // std::invalid_argument if the update can't be buffered (e.g. sparse columns): the
+    // input is then closed, and takes no further part in the table.
     void push(const std::string & name, pvxs::Value value);
 
-    // Extract a time-aligned table chunk, between start and end
-    pvxs::Value extract(const TimeStamp & start, const TimeStamp & end);
+    // Extract a time-aligned table chunk, between start and end. If max_rows is not 0 and the
+    // chunk would have more rows, end is pulled back so it doesn't. The end actually used
+    // is stored in extracted_end, if given.
+    pvxs::Value extract(const TimeStamp & start, const TimeStamp & end,
+        size_t max_rows = 0, TimeStamp *extracted_end = nullptr);
 
     // Build an empty value
     pvxs::Value create() const;
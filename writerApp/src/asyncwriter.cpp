@@ -0,0 +1,208 @@
+#include "asyncwriter.h"
+
+#include <algorithm>
+
+#include <pvxs/log.h>
+
+#include <epicsTime.h>
+
+DEFINE_LOGGER(LOG, "writer.async");
+
+typedef epicsGuard<epicsMutex> Guard;
+
+namespace tabulator {
+
+AsyncWriter::AsyncWriter(size_t capacity, Factory factory)
+: capacity_(std::max<size_t>(capacity, 1)), factory_(factory), lock_(), items_(),
+  not_empty_(), not_full_(), error_(), stats_(), writer_(), running_(false),
+  thread_(*this, "writer", epicsThreadGetStackSize(epicsThreadStackMedium), epicsThreadPriorityMedium)
+{}
+
+AsyncWriter::~AsyncWriter() {
+    if (running_) {
+        try {
+            push(Item{Item::STOP, std::string(), pvxs::Value()});
+        } catch (...) {
+            // The writer thread already stopped
+        }
+
+        thread_.exitWait();
+        running_ = false;
+    }
+}
+
+void AsyncWriter::start() {
+    running_ = true;
+    thread_.start();
+}
+
+void AsyncWriter::push(Item item) {
+    bool blocked = false;
+    epicsTimeStamp block_start;
+
+    for (;;) {
+        {
+            Guard G(lock_);
+
+            if (error_)
+                std::rethrow_exception(error_);
+
+            if (items_.size() < capacity_) {
+                items_.push_back(std::move(item));
+                stats_.high_water = std::max(stats_.high_water, items_.size());
+
+                if (blocked) {
+                    epicsTimeStamp now;
+                    epicsTimeGetCurrent(&now);
+                    stats_.blocked_sec += epicsTimeDiffInSeconds(&now, &block_start);
+                }
+
+                break;
+            }
+
+            if (!blocked) {
+                blocked = true;
+                ++stats_.blocked;
+                epicsTimeGetCurrent(&block_start);
+                log_debug_printf(LOG, "Write queue full (%lu items), waiting for the writer thread\n", items_.size());
+            }
+        }
+
+        not_full_.wait();
+    }
+
+    not_empty_.signal();
+}
+
+// Waits up to timeout seconds (forever if negative) for an item. Returns false on timeout.
+bool AsyncWriter::pop(Item & item, double timeout) {
+    for (;;) {
+        {
+            Guard G(lock_);
+
+            if (!items_.empty()) {
+                item = std::move(items_.front());
+                items_.pop_front();
+                break;
+            }
+        }
+
+        if (timeout < 0) {
+            not_empty_.wait();
+        } else if (!not_empty_.wait(timeout)) {
+            return false;
+        }
+    }
+
+    not_full_.signal();
+    return true;
+}
+
+void AsyncWriter::report() {
+    auto stats = take_stats();
+
+    log_info_printf(LOG, "Write queue: high-water mark %lu of %lu, receiving blocked %lu times for %.3f s\n",
+        stats.high_water, capacity_, stats.blocked, stats.blocked_sec);
+}
+
+void AsyncWriter::open(const std::string & path) {
+    push(Item{Item::OPEN, path, pvxs::Value()});
+}
+
+void AsyncWriter::write(pvxs::Value value) {
+    push(Item{Item::UPDATE, std::string(), value});
+}
+
+void AsyncWriter::close() {
+    push(Item{Item::CLOSE, std::string(), pvxs::Value()});
+    report();
+}
+
+void AsyncWriter::finish() {
+    if (!running_)
+        return;
+
+    push(Item{Item::STOP, std::string(), pvxs::Value()});
+    thread_.exitWait();
+    running_ = false;
+    report();
+
+    Guard G(lock_);
+    if (error_)
+        std::rethrow_exception(error_);
+}
+
+AsyncWriter::Stats AsyncWriter::take_stats() {
+    Guard G(lock_);
+    Stats stats = stats_;
+    stats_ = Stats();
+    return stats;
+}
+
+void AsyncWriter::run() {
+    log_debug_printf(LOG, "Starting%s\n", "");
+
+    for (;;) {
+        try {
+            Item item;
+
+            // Flush written updates that are due, even if no more updates come
+            if (!pop(item, writer_ ? writer_->until_flush() : -1.0)) {
+                writer_->flush();
+                continue;
+            }
+
+            switch (item.kind) {
+                case Item::OPEN:
+                    if (writer_)
+                        writer_->close();
+
+                    writer_.reset(factory_(item.path));
+                    break;
+
+                case Item::UPDATE:
+                    if (writer_)
+                        writer_->write(item.value);
+                    break;
+
+                case Item::CLOSE:
+                    if (writer_)
+                        writer_->close();
+
+                    writer_.reset();
+                    break;
+
+                case Item::STOP:
+                    if (writer_)
+                        writer_->close();
+
+                    writer_.reset();
+                    log_debug_printf(LOG, "Ending%s\n", "");
+                    return;
+            }
+        } catch (...) {
+            // Save whatever can still be saved
+            if (writer_) {
+                try {
+                    writer_->close();
+                } catch (...) {
+                    log_warn_printf(LOG, "Failed to close '%s' after an error\n", writer_->get_file_path().c_str());
+                }
+            }
+
+            writer_.reset();
+
+            {
+                Guard G(lock_);
+                error_ = std::current_exception();
+            }
+
+            // Don't leave the receiving side waiting for room
+            not_full_.signal();
+            log_debug_printf(LOG, "Ending after an error%s\n", "");
+            return;
+        }
+    }
+}
+
+} // namespace tabulator
@@ -0,0 +1,103 @@
+#ifndef TAB_ASYNCWRITER_H
+#define TAB_ASYNCWRITER_H
+
+#include <deque>
+#include <string>
+#include <memory>
+#include <exception>
+#include <functional>
+
+#include <epicsMutex.h>
+#include <epicsEvent.h>
+#include <epicsThread.h>
+
+#include <pvxs/data.h>
+
+#include "writer.h"
+
+namespace tabulator {
+
+/* AsyncWriter
+ *
+ * Writes updates to HDF5 files on a thread of its own, so that receiving updates
+ * and writing them to disk overlap. Updates wait in a bounded queue: once it is
+ * full, write() blocks until the writer thread catches up. How full the queue got
+ * and how long receiving was blocked are logged whenever a file is closed.
+ *
+ * While idle, the writer thread still flushes written updates once they are due
+ * (see Writer::until_flush()), so a crash loses no more than the flush interval.
+ *
+ * All HDF5 calls happen on the writer thread. Errors there stop the writer thread
+ * and are rethrown by the next call from the receiving side.
+ *
+ * Meant to be fed by a single thread.
+ */
+class AsyncWriter : public epicsThreadRunable {
+
+public:
+    // Creates the Writer of a new file
+    typedef std::function<Writer*(const std::string & path)> Factory;
+
+    struct Stats {
+        size_t high_water;  // Most items queued at once
+        size_t blocked;     // Times write() had to wait for room in the queue
+        double blocked_sec; // Time spent waiting
+    };
+
+private:
+    struct Item {
+        enum Kind { OPEN, UPDATE, CLOSE, STOP } kind;
+        std::string path;
+        pvxs::Value value;
+    };
+
+    const size_t capacity_;
+    const Factory factory_;
+
+    mutable epicsMutex lock_;
+    std::deque<Item> items_;
+    epicsEvent not_empty_;
+    epicsEvent not_full_;
+    std::exception_ptr error_;
+    Stats stats_;
+
+    // Writer thread
+    std::unique_ptr<Writer> writer_;
+    bool running_;
+    epicsThread thread_;
+
+    void push(Item item);
+    bool pop(Item & item, double timeout);
+    void report();
+
+public:
+    // capacity: how many updates (and file changes) may wait to be written
+    AsyncWriter(size_t capacity, Factory factory);
+
+    // Writes whatever is still queued, then stops the writer thread
+    virtual ~AsyncWriter();
+
+    void start();
+
+    // Updates written from now on go to a new file at path
+    void open(const std::string & path);
+
+    // Queues an update. Blocks while the queue is full.
+    void write(pvxs::Value value);
+
+    // Closes the current file, once its queued updates are written
+    void close();
+
+    // Writes whatever is still queued and stops the writer thread.
+    // Rethrows the error that stopped it, if any.
+    void finish();
+
+    // Queue statistics since the previous call
+    Stats take_stats();
+
+    void run();
+};
+
+} // namespace tabulator
+
+#endif
@@ -2,6 +2,7 @@
 
 #include <exception>
 #include <iostream>
+#include <algorithm>
 #include <set>
 #include <vector>
 
@@ -11,6 +12,9 @@
 
 #include <highfive/H5File.hpp>
 
+#include <hdf5.h>
+#include <zlib.h>
+
 DEFINE_LOGGER(LOG, "writer");
 
 static const std::string META_GROUP = "/meta";
@@ -24,9 +28,13 @@ static const std::string ATTR_INPUT_PV = "Input PV";
 static const std::string ATTR_SIGNAL = "Signal";
 static const std::string ATTR_LABEL = "NTTable label";
 static const std::string ATTR_COLUMN = "NTTable column";
+static const std::string ATTR_SIGNALS = "Signals";
 
 static const char *DATA_GROUP = "/data";
 
+// Chunks of variable length strings hold references to the strings, this big
+static const size_t VLEN_STRING_BYTES = 16;
+
 namespace H5 = HighFive;
 
 namespace tabulator {
@@ -84,16 +92,172 @@ static bool parts(const std::string & name, const std::string & sep, std::string
     return true;
 }
 
-void Writer::build_file_structure(size_t chunk_size) {
+// Time span of the rows of value, if it has any
+static bool time_span(const pvxs::Value & value, epicsTimeStamp & first, epicsTimeStamp & last, size_t & num_rows) {
+    auto columns = value[nt::NTTable::COLUMNS_FIELD];
+    auto seconds = columns[TimeTable::SECONDS_PAST_EPOCH_COL].as<pvxs::shared_array<const TimeTable::SECONDS_PAST_EPOCH_T>>();
+    auto nanoseconds = columns[TimeTable::NANOSECONDS_COL].as<pvxs::shared_array<const TimeTable::NANOSECONDS_T>>();
+
+    num_rows = std::min(seconds.size(), nanoseconds.size());
+
+    if (num_rows == 0)
+        return false;
+
+    first = { seconds[0], nanoseconds[0] };
+    last = { seconds[num_rows - 1], nanoseconds[num_rows - 1] };
+    return true;
+}
+
+// Bytes of the columns of value
+static size_t value_bytes(const pvxs::Value & value) {
+    size_t bytes = 0;
+
+    for (auto column : value[nt::NTTable::COLUMNS_FIELD].ichildren()) {
+        auto contents = column.as<pvxs::shared_array<const void>>();
+        bytes += contents.original_type() == pvxs::ArrayType::String
+            ? contents.size() * sizeof(std::string) : contents.size() * pvxs::elementSize(contents.original_type());
+    }
+
+    return bytes;
+}
+
+// Rows of updates, and the time span they cover
+static size_t count_rows(const std::vector<pvxs::Value> & updates, double & span_sec) {
+    epicsTimeStamp first = {}, last = {};
+    size_t total_rows = 0;
+
+    for (const auto & v : updates) {
+        epicsTimeStamp v_first, v_last;
+        size_t num_rows;
+
+        if (!time_span(v, v_first, v_last, num_rows))
+            continue;
+
+        if (total_rows == 0)
+            first = v_first;
+
+        last = v_last;
+        total_rows += num_rows;
+    }
+
+    span_sec = total_rows > 0 ? epicsTimeDiffInSeconds(&last, &first) : 0.0;
+    return total_rows;
+}
+
+size_t Writer::chunk_rows(pvxs::TypeCode type_code, double rows_per_sec) const {
+    size_t width = type_code.code == pvxs::TypeCode::StringA
+        ? VLEN_STRING_BYTES : pvxs::elementSize(type_code.arrayType());
+
+    double rows = double(chunk_policy_.target_bytes) / width;
+
+    if (rows_per_sec > 0 && chunk_policy_.max_span_sec > 0)
+        rows = std::min(rows, rows_per_sec * chunk_policy_.max_span_sec);
+
+    // Round down to a power of two
+    size_t chunk = 1;
+    while (2.0 * chunk <= rows)
+        chunk *= 2;
+
+    return chunk;
+}
+
+// Filters a chunk the way HDF5's shuffle and deflate filters would. A partial
+// chunk is padded with zeros to the full chunk size, as HDF5 stores it.
+static std::vector<uint8_t> filter_chunk(const uint8_t * rows, size_t num_rows, size_t chunk_rows,
+    size_t element_size, bool shuffle, bool deflate, unsigned level)
+{
+    std::vector<uint8_t> chunk(chunk_rows * element_size, 0);
+    std::copy(rows, rows + num_rows * element_size, chunk.begin());
+
+    // Byte b of every element goes to the b-th block of the chunk
+    if (shuffle && element_size > 1) {
+        std::vector<uint8_t> shuffled(chunk.size());
+
+        for (size_t i = 0; i < chunk_rows; ++i)
+            for (size_t b = 0; b < element_size; ++b)
+                shuffled[b * chunk_rows + i] = chunk[i * element_size + b];
+
+        chunk.swap(shuffled);
+    }
+
+    if (!deflate)
+        return chunk;
+
+    uLongf size = compressBound(chunk.size());
+    std::vector<uint8_t> compressed(size);
+
+    if (compress2(compressed.data(), &size, chunk.data(), chunk.size(), level) != Z_OK)
+        throw std::runtime_error("Failed to deflate chunk");
+
+    compressed.resize(size);
+    return compressed;
+}
+
+size_t Writer::Column::pending_rows() const {
+    return element_size > 0 ? rows.size() / element_size : strings.size();
+}
+
+void Writer::Column::append(const void * data, size_t num_rows) {
+    auto bytes = static_cast<const uint8_t*>(data);
+    rows.insert(rows.end(), bytes, bytes + num_rows * element_size);
+}
+
+void Writer::Column::append(const std::string * data, size_t num_rows) {
+    strings.insert(strings.end(), data, data + num_rows);
+}
+
+void Writer::build_file_structure(double rows_per_sec) {
     epicsTimeStamp start, end;
     epicsTimeGetCurrent(&start);
 
     file_->createAttribute(ATTR_INPUT_PV, input_pv_);
 
-    H5::DataSetCreateProps props;
-    props.add(H5::Chunking({chunk_size}));
+    // Creates the dataset of a column, with chunks sized for its element type
+    // and the filters of its class
+    auto create = [this, rows_per_sec](H5::Group & group, const std::string & name,
+        const nt::NTTable::ColumnSpec & c, pvxs::TypeCode type_code, CompressPolicy::Class cls)
+    {
+        size_t chunk = chunk_rows(type_code, rows_per_sec);
+        bool strings = type_code.code == pvxs::TypeCode::StringA;
+        bool filtered = !strings && compress_policy_.filtered(cls);
+        size_t element_size = strings ? 0 : pvxs::elementSize(type_code.arrayType());
+        bool shuffle = filtered && compress_policy_.shuffle[cls] && element_size > 1;
+        bool deflate = filtered && compress_policy_.deflate[cls];
+
+        log_debug_printf(LOG, "  Chunks of %lu rows for type %s%s%s\n", chunk, type_code.name(),
+            shuffle ? ", shuffled" : "", deflate ? ", deflated" : "");
+
+        H5::DataSetCreateProps props;
+        props.add(H5::Chunking({chunk}));
+
+        if (shuffle)
+            props.add(H5::Shuffle());
+
+        if (deflate)
+            props.add(H5::Deflate(compress_policy_.level));
+
+        auto type = pvxs_to_h5_type(type_code);
+        auto ds = group.createDataSet(
+            name,
+            H5::DataSpace({0}, {H5::DataSpace::UNLIMITED}),
+            type,
+            props
+        );
+
+        ds.createAttribute(ATTR_LABEL, c.label);
+        ds.createAttribute(ATTR_COLUMN, c.name);
+
+        columns_.emplace(c.name, Column{ds, type, element_size, chunk, filtered, shuffle, deflate,
+            0, 0, 0, std::vector<uint8_t>(), std::vector<std::string>(), 0, 0, 0, 0, 0.0});
+
+        if (filtered)
+            ++num_filtered_;
+
+        return ds;
+    };
 
-    log_debug_printf(LOG, "Building file structure with chunk_size=%lu\n", chunk_size);
+    log_debug_printf(LOG, "Building file structure for %.1f rows/sec, %lu bytes per chunk\n",
+        rows_per_sec, chunk_policy_.target_bytes);
 
     // Groups to hold metadata and data
     auto meta_group = file_->createGroup(META_GROUP);
@@ -119,28 +283,27 @@ void Writer::build_file_structure(size_t chunk_size) {
         types.push_back(c.type_code.code);
     }
 
-    for (auto c : type_->time_columns) {
-        auto ds = root_group.createDataSet(
-            c.name,
-            H5::DataSpace({0}, {H5::DataSpace::UNLIMITED}),
-            pvxs_to_h5_type(c.type_code),
-            props
-        );
+    for (auto c : type_->time_columns)
+        create(root_group, c.name, c, c.type_code, CompressPolicy::TIME);
 
-        ds.createAttribute(ATTR_LABEL, c.label);
-        ds.createAttribute(ATTR_COLUMN, c.name);
-        datasets_.emplace(c.name, ds);
-    }
+    std::vector<nt::NTTable::ColumnSpec> validity_columns;
+    std::map<std::string, std::string> sparse_prefixes;    // Column prefix -> its sparse rows column
 
     for (auto c : type_->data_columns) {
         std::string pvname, column_prefix, column_suffix;
 
-        if (!parts(c.label, label_sep_, &pvname, NULL))
-            throw std::runtime_error(std::string("Invalid label name (must contain '") + label_sep_ + "'): " + c.label);
-
         if (!parts(c.name, col_sep_, &column_prefix, &column_suffix))
             throw std::runtime_error(std::string("Invalid column name (must contain '") + col_sep_ + "'): " + c.name);
 
+        // Packed validity doesn't belong to any signal, handle it once all signals are known
+        if (column_prefix == TimeTable::VALIDITY_PREFIX) {
+            validity_columns.push_back(c);
+            continue;
+        }
+
+        if (!parts(c.label, label_sep_, &pvname, NULL))
+            throw std::runtime_error(std::string("Invalid label name (must contain '") + label_sep_ + "'): " + c.label);
+
         if (pvnames_set.find(pvname) == pvnames_set.end()) {
             pvnames.push_back(pvname);
             pvnames_set.insert(pvname);
@@ -152,17 +315,42 @@ void Writer::build_file_structure(size_t chunk_size) {
 
         auto group = root_group.getGroup(column_prefix);
 
-        auto ds = group.createDataSet(
-            column_suffix,
-            H5::DataSpace({0}, {H5::DataSpace::UNLIMITED}),
-            pvxs_to_h5_type(c.type_code),
-            props
-        );
+        // Sparse rows are stored as row numbers in the file, which may outgrow the column type
+        bool sparse_rows = column_suffix == TimeTable::SPARSE_ROWS_COL;
+        auto sparse = sparse_prefixes.find(column_prefix);
 
-        ds.createAttribute(ATTR_LABEL, c.label);
-        ds.createAttribute(ATTR_COLUMN, c.name);
+        if (sparse_rows) {
+            sparse_prefixes[column_prefix] = c.name;
+            sparse_rows_[c.name] = c.name;
+        } else if (sparse != sparse_prefixes.end()) {
+            sparse_rows_[sparse->second] = c.name;
+        }
+
+        if (sparse_rows)
+            create(group, column_suffix, c, pvxs::TypeCode::UInt64A, CompressPolicy::TIME);
+        else
+            create(group, column_suffix, c, c.type_code, CompressPolicy::DATA);
+    }
+
+    // Packed validity: bit b of the n-th validity column tells whether
+    // signal (n*VALIDITY_BITS + b) has data in that row
+    if (!validity_columns.empty()) {
+        auto group = root_group.createGroup(TimeTable::VALIDITY_PREFIX);
+
+        for (size_t n = 0; n < validity_columns.size(); ++n) {
+            const auto & c = validity_columns[n];
+            std::string column_suffix;
+            parts(c.name, col_sep_, NULL, &column_suffix);
+
+            if (c.type_code != pvxs::TypeCode::UInt64A)
+                throw std::runtime_error(std::string("Invalid type for validity column: ") + c.name);
 
-        datasets_.emplace(c.name, ds);
+            size_t first = std::min(n * TimeTable::VALIDITY_BITS, pvnames.size());
+            size_t last = std::min(first + TimeTable::VALIDITY_BITS, pvnames.size());
+
+            auto ds = create(group, column_suffix, c, c.type_code, CompressPolicy::VALIDITY);
+            ds.createAttribute(ATTR_SIGNALS, std::vector<std::string>(pvnames.begin() + first, pvnames.begin() + last));
+        }
     }
 
     // Fill meta datasets
@@ -177,23 +365,50 @@ void Writer::build_file_structure(size_t chunk_size) {
 }
 
 Writer::Writer(const std::string & input_pv, const std::string & path, const std::string & root_group,
-    const std::string & label_sep, const std::string & col_sep)
+    const std::string & label_sep, const std::string & col_sep, FlushPolicy flush_policy, ChunkPolicy chunk_policy,
+    CompressPolicy compress_policy)
 :input_pv_(input_pv), type_(nullptr), file_path_(path), file_(new H5::File(path, H5F_ACC_EXCL)), root_group_(root_group),
- label_sep_(label_sep), col_sep_(col_sep) {
+ label_sep_(label_sep), col_sep_(col_sep), num_rows_(0), compress_policy_(compress_policy), num_filtered_(0), pool_(),
+ chunk_policy_(chunk_policy), warmup_(),
+ flush_policy_(flush_policy), unflushed_rows_(0), unflushed_bytes_(0),
+ unflushed_since_(), partial_unflushed_(false), partial_since_(), num_writes_(0), write_sec_(0.0), num_flushes_(0), flush_sec_(0.0),
+ num_dataset_writes_(0), num_resizes_(0) {
     log_debug_printf(LOG, "Writing to file '%s'\n", path.c_str());
+
+    for (size_t c = 0; c < CompressPolicy::NUM_CLASSES; ++c) {
+        if (compress_policy_.filtered(CompressPolicy::Class(c))) {
+            pool_.reset(new WorkerPool(compress_policy_.threads));
+            break;
+        }
+    }
 }
 
-template<typename T>
-static void write_dataset(H5::DataSet & dataset, const TimeTableValue & value, const std::string & colname) {
-    auto data = value.get_column_as<T>(colname);
-    size_t len = data.size();
-
-    auto dims = dataset.getDimensions();
-    dims[0] += len;
-    dataset.resize(dims);
-    dataset
-        .select({dims[0] - len}, {len})
-        .write_raw(data.dataPtr().get());
+Writer::~Writer() {
+    log_info_printf(LOG, "Closing file '%s': %lu updates written in %.3f sec, %lu flushes in %.3f sec, "
+        "%lu dataset writes, %lu dataset resizes\n", file_path_.c_str(), num_writes_, write_sec_,
+        num_flushes_, flush_sec_, num_dataset_writes_, num_resizes_);
+}
+
+
+// Sparse rows are stored as row numbers in the file. When an input was sent dense,
+// with as many values as rows, all rows are stored.
+static std::vector<uint64_t> sparse_row_numbers(const TimeTableValue & value, const std::string & colname,
+    const std::string & refname, size_t first_row, size_t num_rows)
+{
+    auto rows = value.get_column_as<TimeTable::SPARSE_ROW_T>(colname);
+    size_t num_values = value.get_column(refname).as<pvxs::shared_array<const void>>().size();
+
+    std::vector<uint64_t> data;
+
+    if (rows.empty() && num_values == num_rows) {
+        for (size_t i = 0; i < num_rows; ++i)
+            data.push_back(first_row + i);
+    } else {
+        for (auto row : rows)
+            data.push_back(first_row + row);
+    }
+
+    return data;
 }
 
 void Writer::write(pvxs::Value value) {
@@ -203,38 +418,108 @@ void Writer::write(pvxs::Value value) {
         return;
     }
 
-    size_t num_rows = 1024;
-
     if( type_ == nullptr) {
-
         log_debug_printf(LOG, "First update, extracting type%s\n", "");
         type_.reset(new TimeTable(value));
+    }
 
-        // Set chunk size to the size of this first update
-        build_file_structure(num_rows);
-    } else {
-        // Check that the update has data to be written
-        num_rows =  type_->wrap(value, false).get_column_as<TimeTable::SECONDS_PAST_EPOCH_T>(
-            TimeTable::SECONDS_PAST_EPOCH_COL).size();
+    // Datasets are created once the row rate is known
+    if (columns_.empty()) {
+        warmup_.push_back(value);
 
-        if (num_rows == 0) {
-            log_warn_printf(LOG, "Zero rows, skip writing%s\n", "");
-            return;
+        // Held back updates count as unflushed: a flush that is due ends the warm-up
+        epicsTimeStamp first, last;
+        size_t num_rows;
+
+        if (time_span(value, first, last, num_rows)) {
+            if (unflushed_rows_ == 0)
+                epicsTimeGetCurrent(&unflushed_since_);
+
+            unflushed_rows_ += num_rows;
+            unflushed_bytes_ += value_bytes(value);
         }
+
+        double span;
+        if (count_rows(warmup_, span) > 0 && (span >= chunk_policy_.warmup_sec || flush_due()))
+            end_warmup();
+
+        return;
+    }
+
+    write_update(value);
+}
+
+void Writer::end_warmup() {
+    double span;
+    size_t total_rows = count_rows(warmup_, span);
+    double rows_per_sec = total_rows > 1 && span > 0 ? (total_rows - 1) / span : 0.0;
+
+    log_debug_printf(LOG, "Measured %.1f rows/sec over %lu rows (%.3f sec)\n", rows_per_sec, total_rows, span);
+
+    build_file_structure(rows_per_sec);
+
+    std::vector<pvxs::Value> updates;
+    updates.swap(warmup_);
+
+    // Held back updates count as unflushed again as they are written, since they arrived
+    epicsTimeStamp since = unflushed_since_;
+    unflushed_rows_ = 0;
+    unflushed_bytes_ = 0;
+
+    for (const auto & v : updates)
+        write_update(v);
+
+    if (unflushed_rows_ > 0)
+        unflushed_since_ = since;
+}
+
+void Writer::close() {
+    if (type_ != nullptr && columns_.empty())
+        end_warmup();
+
+    flush();
+    trim();
+    report_compression();
+}
+
+void Writer::write_update(pvxs::Value value) {
+    // Check that the update has data to be written
+    size_t num_rows = type_->wrap(value, false).get_column_as<TimeTable::SECONDS_PAST_EPOCH_T>(
+        TimeTable::SECONDS_PAST_EPOCH_COL).size();
+
+    if (num_rows == 0) {
+        log_warn_printf(LOG, "Zero rows, skip writing%s\n", "");
+        return;
     }
 
     epicsTimeStamp start, end;
     epicsTimeGetCurrent(&start);
 
     auto tvalue = type_->wrap(value, true);
+    size_t update_bytes = value_bytes(value);
+
+    // Where this update starts in the file, and how many rows it has
+    size_t first_row = num_rows_;
+    size_t update_rows = tvalue.get_column_as<TimeTable::SECONDS_PAST_EPOCH_T>(TimeTable::SECONDS_PAST_EPOCH_COL).size();
 
     for (auto c : type_->columns) {
-        auto ds = datasets_.find(c.name);
-        if (ds == datasets_.end())
+        auto column = columns_.find(c.name);
+        if (column == columns_.end())
             throw std::logic_error(std::string("Can't find dataset: ") + c.name);
 
+        auto sparse = sparse_rows_.find(c.name);
+        if (sparse != sparse_rows_.end()) {
+            auto rows = sparse_row_numbers(tvalue, c.name, sparse->second, first_row, update_rows);
+            column->second.append(rows.data(), rows.size());
+            continue;
+        }
+
         switch (c.type_code.code) {
-            #define CASE(PT, T) case pvxs::TypeCode::PT: write_dataset<T>(ds->second, tvalue, c.name); break
+            #define CASE(PT, T) case pvxs::TypeCode::PT: {\
+                auto data = tvalue.get_column_as<T>(c.name);\
+                column->second.append(data.data(), data.size());\
+                break;\
+            }
             CASE(BoolA,    bool);
             CASE(Int8A,    int8_t);
             CASE(Int16A,   int16_t);
@@ -254,9 +539,290 @@ void Writer::write(pvxs::Value value) {
         }
     }
 
+    num_rows_ += update_rows;
+    write_pending(false, false);
+
+    epicsTimeGetCurrent(&end);
+
+    double write_sec = epicsTimeDiffInSeconds(&end, &start);
+    ++num_writes_;
+    write_sec_ += write_sec;
+    log_debug_printf(LOG, "Wrote update to file in %.3f sec (%lu rows)\n", write_sec, num_rows);
+
+    if (unflushed_rows_ == 0)
+        unflushed_since_ = end;
+
+    unflushed_rows_ += update_rows;
+    unflushed_bytes_ += update_bytes;
+
+    // Rewriting partial chunks of filtered datasets costs another round of filtering,
+    // so only flushes by age write them
+    if (flush_due())
+        flush_to_disk(until_flush() == 0.0);
+}
+
+bool Writer::flush_due() const {
+    if (flush_policy_.interval_sec == 0 && flush_policy_.rows == 0 && flush_policy_.bytes == 0)
+        return true;
+
+    if (flush_policy_.rows > 0 && unflushed_rows_ >= flush_policy_.rows)
+        return true;
+
+    if (flush_policy_.bytes > 0 && unflushed_bytes_ >= flush_policy_.bytes)
+        return true;
+
+    return until_flush() == 0.0;
+}
+
+void Writer::flush() {
+    if (unflushed_rows_ == 0 && !partial_unflushed_)
+        return;
+
+    // Updates held back to measure the row rate can't wait any longer
+    if (type_ != nullptr && columns_.empty()) {
+        end_warmup();
+
+        if (unflushed_rows_ == 0 && !partial_unflushed_)
+            return;
+    }
+
+    flush_to_disk(true);
+}
+
+void Writer::flush_to_disk(bool partial_chunks) {
+    epicsTimeStamp start, end;
+    epicsTimeGetCurrent(&start);
+
+    // Flushed datasets end where their data does, should the file never be closed
+    write_pending(true, partial_chunks);
+    trim();
     file_->flush();
+
     epicsTimeGetCurrent(&end);
-    log_debug_printf(LOG, "Wrote update to file in %.3f sec (%lu rows)\n", epicsTimeDiffInSeconds(&end, &start), num_rows);
+
+    double flush_sec = epicsTimeDiffInSeconds(&end, &start);
+    ++num_flushes_;
+    flush_sec_ += flush_sec;
+    log_debug_printf(LOG, "Flushed file in %.3f sec (%lu rows, %lu bytes)\n", flush_sec, unflushed_rows_, unflushed_bytes_);
+
+    // Rows left in partial chunks are as old as the oldest update just flushed, at most
+    if (partial_chunks) {
+        partial_unflushed_ = false;
+    } else if (!partial_unflushed_ && unflushed_rows_ > 0) {
+        for (const auto & it : columns_) {
+            if (it.second.filtered && it.second.pending_rows() > 0) {
+                partial_unflushed_ = true;
+                partial_since_ = unflushed_since_;
+                break;
+            }
+        }
+    }
+
+    unflushed_rows_ = 0;
+    unflushed_bytes_ = 0;
+}
+
+// Grows the extent of a dataset to hold at least num_rows: exactly (when about to
+// flush, which trims extents anyway), or doubling it to resize rarely
+void Writer::reserve(Column & column, size_t num_rows, bool exact) {
+    if (num_rows <= column.extent)
+        return;
+
+    size_t extent = num_rows;
+
+    if (!exact) {
+        extent = std::max(num_rows, 2 * column.extent);
+        extent = (extent + column.chunk_rows - 1) / column.chunk_rows * column.chunk_rows;
+    }
+
+    column.dataset.resize({extent});
+    column.extent = extent;
+    ++num_resizes_;
+}
+
+// Writes the first num_rows pending rows of an unfiltered dataset
+void Writer::write_rows(Column & column, size_t num_rows, bool exact) {
+    if (num_rows == 0)
+        return;
+
+    reserve(column, column.length + num_rows, exact);
+
+    auto selection = column.dataset.select({column.length}, {num_rows});
+
+    if (column.element_size == 0) {
+        selection.write_raw(column.strings.data(), column.type);
+        column.strings.erase(column.strings.begin(), column.strings.begin() + num_rows);
+    } else {
+        selection.write_raw(column.rows.data(), column.type);
+        column.rows.erase(column.rows.begin(), column.rows.begin() + num_rows * column.element_size);
+    }
+
+    column.length += num_rows;
+    column.pending_from = column.length;
+    ++num_dataset_writes_;
+}
+
+// Filters the whole chunks of rows pending in filtered datasets (and the partial
+// last ones, if asked to) on the worker pool, then writes them in order on this
+// thread. Rows of a partial chunk are kept, to write it again once it grows.
+void Writer::write_chunks(bool partial, bool exact) {
+    struct Task {
+        Column *column;
+        size_t chunk;       // Index among the column's pending chunks
+        size_t num_rows;
+        std::vector<uint8_t> filtered;
+        double sec;
+    };
+
+    std::vector<Task> tasks;
+
+    for (auto & it : columns_) {
+        auto & c = it.second;
+
+        if (!c.filtered)
+            continue;
+
+        size_t pending_rows = c.pending_rows();
+
+        for (size_t chunk = 0; chunk * c.chunk_rows < pending_rows; ++chunk) {
+            size_t num_rows = std::min(c.chunk_rows, pending_rows - chunk * c.chunk_rows);
+
+            // Partial chunks that didn't grow since last written are left alone
+            if (num_rows < c.chunk_rows && (!partial || c.pending_from + chunk * c.chunk_rows + num_rows == c.length))
+                break;
+
+            tasks.push_back(Task{&c, chunk, num_rows, std::vector<uint8_t>(), 0.0});
+        }
+    }
+
+    if (tasks.empty())
+        return;
+
+    pool_->parallel_for(tasks.size(), [this, &tasks](size_t i) {
+        auto & t = tasks[i];
+        const auto & c = *t.column;
+
+        epicsUInt64 start = epicsMonotonicGet();
+        t.filtered = filter_chunk(c.rows.data() + t.chunk * c.chunk_rows * c.element_size, t.num_rows,
+            c.chunk_rows, c.element_size, c.shuffle, c.deflate, compress_policy_.level);
+        t.sec = (epicsMonotonicGet() - start) * 1e-9;
+    });
+
+    for (auto & t : tasks) {
+        auto & c = *t.column;
+        hsize_t offset = c.pending_from + t.chunk * c.chunk_rows;
+
+        reserve(c, offset + t.num_rows, exact);
+        c.length = std::max<size_t>(c.length, offset + t.num_rows);
+
+        // Filter mask 0: all of the dataset's filters were applied
+        if (H5Dwrite_chunk(c.dataset.getId(), H5P_DEFAULT, 0, &offset, t.filtered.size(), t.filtered.data()) < 0)
+            throw std::runtime_error(std::string("Failed to write chunk of dataset ") + c.dataset.getPath());
+
+        ++num_dataset_writes_;
+
+        size_t raw_bytes = t.num_rows * c.element_size;
+        c.compress_sec += t.sec;
+
+        if (t.num_rows < c.chunk_rows) {
+            c.partial_raw_bytes = raw_bytes;
+            c.partial_compressed_bytes = t.filtered.size();
+        } else {
+            c.raw_bytes += raw_bytes;
+            c.compressed_bytes += t.filtered.size();
+            c.partial_raw_bytes = 0;
+            c.partial_compressed_bytes = 0;
+        }
+    }
+
+    // Whole chunks are done with
+    for (auto & it : columns_) {
+        auto & c = it.second;
+
+        if (!c.filtered)
+            continue;
+
+        size_t whole = c.pending_rows() / c.chunk_rows;
+
+        c.rows.erase(c.rows.begin(), c.rows.begin() + whole * c.chunk_rows * c.element_size);
+        c.pending_from += whole * c.chunk_rows;
+    }
+}
+
+// Writes pending rows that end on a chunk boundary. Also writes the rest of the rows
+// of unfiltered datasets if all_rows, and partial chunks of filtered ones if partial_chunks.
+void Writer::write_pending(bool all_rows, bool partial_chunks) {
+    for (auto & it : columns_) {
+        auto & c = it.second;
+
+        if (c.filtered)
+            continue;
+
+        size_t end_row = c.length + c.pending_rows();
+
+        if (!all_rows)
+            end_row = end_row / c.chunk_rows * c.chunk_rows;
+
+        if (end_row > c.length)
+            write_rows(c, end_row - c.length, all_rows);
+    }
+
+    write_chunks(partial_chunks, all_rows);
+}
+
+// Shrinks the extents grown ahead of the rows to the rows written
+void Writer::trim() {
+    for (auto & it : columns_) {
+        auto & c = it.second;
+
+        if (c.extent > c.length) {
+            c.dataset.resize({c.length});
+            c.extent = c.length;
+            ++num_resizes_;
+        }
+    }
+}
+
+void Writer::report_compression() const {
+    if (num_filtered_ == 0)
+        return;
+
+    size_t total_raw = 0, total_compressed = 0;
+    double total_sec = 0.0;
+
+    for (const auto & it : columns_) {
+        const auto & c = it.second;
+
+        if (!c.filtered)
+            continue;
+
+        size_t raw = c.raw_bytes + c.partial_raw_bytes;
+        size_t compressed = c.compressed_bytes + c.partial_compressed_bytes;
+
+        log_debug_printf(LOG, "  %s: %lu -> %lu bytes (ratio %.2f) in %.3f sec\n", it.first.c_str(),
+            raw, compressed, compressed > 0 ? double(raw) / compressed : 0.0, c.compress_sec);
+
+        total_raw += raw;
+        total_compressed += compressed;
+        total_sec += c.compress_sec;
+    }
+
+    log_info_printf(LOG, "Compressed %lu datasets: %lu -> %lu bytes (ratio %.2f) in %.3f sec on %lu threads\n",
+        num_filtered_, total_raw, total_compressed,
+        total_compressed > 0 ? double(total_raw) / total_compressed : 0.0, total_sec, pool_->size());
+}
+
+double Writer::until_flush() const {
+    if ((unflushed_rows_ == 0 && !partial_unflushed_) || flush_policy_.interval_sec == 0)
+        return -1.0;
+
+    // Partial chunks left out of earlier flushes hold the oldest rows, if any
+    const epicsTimeStamp & since = partial_unflushed_ ? partial_since_ : unflushed_since_;
+
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+
+    return std::max(flush_policy_.interval_sec - epicsTimeDiffInSeconds(&now, &since), 0.0);
 }
 
 std::string Writer::get_file_path() const {
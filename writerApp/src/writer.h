@@ -2,16 +2,97 @@
 #define TAB_WRITER_H
 
 #include <tab/timetable.h>
+#include <tab/workerpool.h>
 
 #include <highfive/H5File.hpp>
 
+#include <epicsTime.h>
+
 #include <map>
+#include <vector>
 
 namespace tabulator {
 
 class Writer {
 
+public:
+    // When written updates are flushed to disk: as soon as any of the limits is
+    // reached since the last flush. With no limits (all 0), after every update.
+    struct FlushPolicy {
+        double interval_sec;    // Age of the oldest unflushed update, in seconds
+        size_t rows;            // Unflushed rows
+        size_t bytes;           // Unflushed bytes
+
+        FlushPolicy(double interval_sec = 0.0, size_t rows = 0, size_t bytes = 0)
+        : interval_sec(interval_sec), rows(rows), bytes(bytes)
+        {}
+    };
+
+    // How datasets are chunked: about target_bytes per chunk, but no more rows than
+    // max_span_sec worth of data (0: no limit), at the row rate measured over the
+    // first warmup_sec of data (0: over the first update), or until a flush is due.
+    // Chunks have a power of two number of rows.
+    struct ChunkPolicy {
+        size_t target_bytes;
+        double warmup_sec;
+        double max_span_sec;
+
+        ChunkPolicy(size_t target_bytes = 64 * 1024, double warmup_sec = 0.0, double max_span_sec = 0.0)
+        : target_bytes(target_bytes), warmup_sec(warmup_sec), max_span_sec(max_span_sec)
+        {}
+    };
+
+    // Which datasets are shuffled and deflated, by column class: TIME (time columns
+    // and sparse rows), VALIDITY (packed validity) and DATA (all other columns).
+    // String columns are never filtered. Chunks of filtered datasets are filtered
+    // by `threads` threads and written as they are, bypassing HDF5's own filters.
+    // Partial last chunks are only written when flushing by age, and on close,
+    // so filtering needs a flush interval to bound what a crash can lose.
+    struct CompressPolicy {
+        enum Class { TIME, VALIDITY, DATA, NUM_CLASSES };
+
+        bool shuffle[NUM_CLASSES];
+        bool deflate[NUM_CLASSES];
+        unsigned level;         // Deflate level, 1 to 9
+        size_t threads;
+
+        CompressPolicy(unsigned level = 4, size_t threads = 1)
+        : shuffle(), deflate(), level(level), threads(threads)
+        {}
+
+        bool filtered(Class c) const { return shuffle[c] || deflate[c]; }
+    };
+
 private:
+    // A dataset and the rows not yet written to it. Rows are written a batch of
+    // whole chunks at a time, or all of them when flushing, into an extent grown
+    // ahead of them and trimmed to the rows written whenever the file is flushed.
+    struct Column {
+        HighFive::DataSet dataset;
+        HighFive::DataType type;
+        size_t element_size;            // 0 for strings
+        size_t chunk_rows;
+        bool filtered;                  // Written by write_chunks()
+        bool shuffle;
+        bool deflate;
+
+        size_t extent;                  // Rows the dataset has room for
+        size_t length;                  // Rows written
+        size_t pending_from;            // First pending row (a chunk boundary, if filtered)
+        std::vector<uint8_t> rows;      // Pending rows
+        std::vector<std::string> strings;
+
+        size_t raw_bytes;               // Written, before and after filtering
+        size_t compressed_bytes;
+        size_t partial_raw_bytes;       // Of the partial chunk last written
+        size_t partial_compressed_bytes;
+        double compress_sec;            // Time spent filtering, across threads
+
+        size_t pending_rows() const;
+        void append(const void * data, size_t num_rows);
+        void append(const std::string * data, size_t num_rows);
+    };
+
     std::string input_pv_;
     std::unique_ptr<TimeTable> type_;
     std::string file_path_;
@@ -19,14 +100,76 @@ private:
     std::string root_group_;
     std::string label_sep_;
     std::string col_sep_;
-    std::map<std::string, HighFive::DataSet> datasets_;
+    std::map<std::string, Column> columns_;
+
+    // Sparse rows column -> a data column of the same input, to tell dense updates apart
+    std::map<std::string, std::string> sparse_rows_;
+
+    // Rows written so far
+    size_t num_rows_;
+
+    // Filtered datasets
+    CompressPolicy compress_policy_;
+    size_t num_filtered_;
+    std::unique_ptr<WorkerPool> pool_;
+
+    // Updates held back until the row rate is known, to size chunks
+    ChunkPolicy chunk_policy_;
+    std::vector<pvxs::Value> warmup_;
+
+    // Written, but not yet flushed
+    FlushPolicy flush_policy_;
+    size_t unflushed_rows_;
+    size_t unflushed_bytes_;
+    epicsTimeStamp unflushed_since_;
+
+    // Rows of partial chunks of filtered datasets, left out of flushes but by age
+    bool partial_unflushed_;
+    epicsTimeStamp partial_since_;
 
-    void build_file_structure(size_t chunk_size);
+    // Time spent writing and flushing
+    size_t num_writes_;
+    double write_sec_;
+    size_t num_flushes_;
+    double flush_sec_;
+
+    // HDF5 calls that write rows or change extents
+    size_t num_dataset_writes_;
+    size_t num_resizes_;
+
+    void build_file_structure(double rows_per_sec);
+    size_t chunk_rows(pvxs::TypeCode type_code, double rows_per_sec) const;
+    void end_warmup();
+    void write_update(pvxs::Value value);
+    bool flush_due() const;
+    void reserve(Column & column, size_t num_rows, bool exact);
+    void write_rows(Column & column, size_t num_rows, bool exact);
+    void write_chunks(bool partial, bool exact);
+    void write_pending(bool all_rows, bool partial_chunks);
+    void flush_to_disk(bool partial_chunks);
+    void trim();
+    void report_compression() const;
 
 public:
     Writer(const std::string & input_pv, const std::string & path, const std::string & root_group,
-        const std::string & label_sep, const std::string & col_sep);
+        const std::string & label_sep, const std::string & col_sep, FlushPolicy flush_policy = FlushPolicy(),
+        ChunkPolicy chunk_policy = ChunkPolicy(), CompressPolicy compress_policy = CompressPolicy());
+    ~Writer();
     void write(pvxs::Value value);
+
+    // Writes updates still held back and flushes, trims datasets to the rows
+    // written and reports how well they compressed. Call before destroying the Writer.
+    void close();
+
+    // Writes all pending rows (including the partial last chunks of filtered
+    // datasets), then flushes written updates to disk, if there are any. Called
+    // when flushing by age.
+    void flush();
+
+    // Seconds until unflushed updates are due to be flushed by age (0 if overdue).
+    // Negative if there are none, or the flush policy has no interval.
+    double until_flush() const;
+
     std::string get_file_path() const;
 
 };
@@ -15,9 +15,40 @@
 #include <libgen.h>
 
 #include "writer.h"
+#include "asyncwriter.h"
 
 DEFINE_LOGGER(LOG, "writerMain");
 
+static const char *COLUMN_CLASS_STR[] = { "time", "validity", "data" };
+
+// Sets classes[c] for each column class named in names. Returns false on unknown names.
+static bool parse_column_classes(const std::vector<std::string> & names, bool *classes) {
+    for (const auto & name : names) {
+        size_t c = 0;
+
+        while (c < tabulator::Writer::CompressPolicy::NUM_CLASSES && name != COLUMN_CLASS_STR[c])
+            ++c;
+
+        if (c == tabulator::Writer::CompressPolicy::NUM_CLASSES)
+            return false;
+
+        classes[c] = true;
+    }
+
+    return true;
+}
+
+static std::string column_classes_str(const bool *classes) {
+    std::string s;
+
+    for (size_t c = 0; c < tabulator::Writer::CompressPolicy::NUM_CLASSES; ++c) {
+        if (classes[c])
+            s += std::string(s.empty() ? "" : " ") + COLUMN_CLASS_STR[c];
+    }
+
+    return s.empty() ? "none" : s;
+}
+
 enum StopReason {
     INTERRUPTED,
     TIMEOUT,
@@ -101,6 +132,16 @@ int main (int argc, char *argv[]) {
     double timeout_sec;
     double max_duration_sec = 0;
     size_t max_size_mb = 0;
+    size_t queue_size = 8;
+    double flush_sec = 0.0;
+    size_t flush_rows = 0;
+    size_t flush_mb = 0;
+    size_t chunk_kb = 64;
+    double chunk_warmup_sec = 0.0;
+    std::vector<std::string> shuffle_classes;
+    std::vector<std::string> deflate_classes;
+    unsigned deflate_level = 4;
+    size_t compress_threads = 1;
     std::string label_sep = ".";
     std::string col_sep = "_";
 
@@ -133,6 +174,46 @@ int main (int argc, char *argv[]) {
             .doc("Maximum size, in MB, to collect data for in a single HDF5 file. If 0, don't limit files by size. Default: 0")
             & clipp::value("max_size_mb", max_size_mb),
 
+        clipp::option("--queue-size")
+            .doc("Maximum number of received updates waiting to be written to disk. Once reached, receiving waits for the writes. Default: 8")
+            & clipp::value("queue_size", queue_size),
+
+        clipp::option("--flush-sec")
+            .doc("Flush written data to disk once the oldest unflushed update is this old, in seconds, even if no more updates arrive. Bounds how much data a crash can lose. If 0, don't flush by age. Default: 0")
+            & clipp::value("flush_sec", flush_sec),
+
+        clipp::option("--flush-rows")
+            .doc("Flush written data to disk once this many rows are unflushed. If 0, don't flush by rows. Default: 0")
+            & clipp::value("flush_rows", flush_rows),
+
+        clipp::option("--flush-mb")
+            .doc("Flush written data to disk once this many MB are unflushed. If 0, don't flush by size. Default: 0. If --flush-sec, --flush-rows and --flush-mb are all 0, flush after every update")
+            & clipp::value("flush_mb", flush_mb),
+
+        clipp::option("--chunk-kb")
+            .doc("Target size, in KB, of the HDF5 chunks of each dataset. Chunks hold no more than --max-duration-sec worth of rows, if given. Default: 64")
+            & clipp::value("chunk_kb", chunk_kb),
+
+        clipp::option("--chunk-warmup-sec")
+            .doc("Time span of data, in seconds, to measure the row rate over before creating the datasets of a file. If 0, measure it over the first update. Default: 0")
+            & clipp::value("chunk_warmup_sec", chunk_warmup_sec),
+
+        clipp::option("--shuffle")
+            .doc("Column classes whose datasets are shuffled before being deflated: any of 'time' (timestamps, pulse IDs, sparse rows), 'validity' (packed validity) and 'data' (all other non-string columns). Default: none")
+            & clipp::values("class", shuffle_classes),
+
+        clipp::option("--deflate")
+            .doc("Column classes whose datasets are deflated, as for --shuffle. Default: none. --shuffle and --deflate need --flush-sec")
+            & clipp::values("class", deflate_classes),
+
+        clipp::option("--deflate-level")
+            .doc("Deflate level, from 1 (fastest) to 9 (smallest). Default: 4")
+            & clipp::value("deflate_level", deflate_level),
+
+        clipp::option("--compress-threads")
+            .doc("Number of threads that shuffle and deflate chunks. Default: 1")
+            & clipp::value("compress_threads", compress_threads),
+
         clipp::option("--label-sep")
             .doc(std::string("separator between PV name and column name in labels. Default: '") + label_sep + "'")
             & clipp::value("label_sep", label_sep),
@@ -167,6 +248,19 @@ int main (int argc, char *argv[]) {
     CHECK_ARG(root_group.empty(), "Root group must not be empty%s\n", "");
     CHECK_ARG(timeout_sec < 0.0, "Invalid timeout: %f seconds\n", timeout_sec);
     CHECK_ARG(max_duration_sec < 0.0, "Invalid duration: %f seconds\n", max_duration_sec);
+    CHECK_ARG(queue_size == 0, "Invalid queue size: %lu\n", queue_size);
+    CHECK_ARG(flush_sec < 0.0, "Invalid flush interval: %f seconds\n", flush_sec);
+    CHECK_ARG(chunk_kb == 0, "Invalid chunk size: %lu KB\n", chunk_kb);
+    CHECK_ARG(chunk_warmup_sec < 0.0, "Invalid chunk warm-up: %f seconds\n", chunk_warmup_sec);
+    CHECK_ARG(deflate_level < 1 || deflate_level > 9, "Invalid deflate level: %u\n", deflate_level);
+    CHECK_ARG(compress_threads == 0, "Invalid number of compression threads: %lu\n", compress_threads);
+
+    tabulator::Writer::CompressPolicy compress_policy(deflate_level, compress_threads);
+
+    CHECK_ARG(!parse_column_classes(shuffle_classes, compress_policy.shuffle), "Invalid column class to shuffle%s\n", "");
+    CHECK_ARG(!parse_column_classes(deflate_classes, compress_policy.deflate), "Invalid column class to deflate%s\n", "");
+    CHECK_ARG((!shuffle_classes.empty() || !deflate_classes.empty()) && flush_sec == 0.0,
+        "--shuffle and --deflate need --flush-sec, to bound what a crash can lose%s\n", "");
 
     struct stat base_dir_stat;
     int base_dir_stat_res = stat(base_directory.c_str(), &base_dir_stat);
@@ -183,9 +277,23 @@ int main (int argc, char *argv[]) {
     log_info_printf(LOG, "  timeout=%f s%s\n", timeout_sec, timeout_sec == 0.0 ? " (wait forever)" : "");
     log_info_printf(LOG, "  max duration=%f s%s\n", max_duration_sec, max_duration_sec == 0.0 ? " (no time limit)" : "");
     log_info_printf(LOG, "  max size=%lu MB%s\n", max_size_mb, max_size_mb == 0 ? " (no size limit)" : "");
+    log_info_printf(LOG, "  queue size=%lu\n", queue_size);
+    if (flush_sec == 0.0 && flush_rows == 0 && flush_mb == 0) {
+        log_info_printf(LOG, "  flush=after every update%s\n", "");
+    } else {
+        log_info_printf(LOG, "  flush=every %f s, %lu rows, %lu MB (0: no limit)\n", flush_sec, flush_rows, flush_mb);
+    }
+    log_info_printf(LOG, "  chunk size=%lu KB\n", chunk_kb);
+    log_info_printf(LOG, "  chunk warm-up=%f s%s\n", chunk_warmup_sec, chunk_warmup_sec == 0.0 ? " (first update)" : "");
+    log_info_printf(LOG, "  shuffle=%s\n", column_classes_str(compress_policy.shuffle).c_str());
+    log_info_printf(LOG, "  deflate=%s (level %u)\n", column_classes_str(compress_policy.deflate).c_str(), deflate_level);
+    log_info_printf(LOG, "  compression threads=%lu\n", compress_threads);
     log_info_printf(LOG, "  label separator='%s'\n", label_sep.c_str());
     log_info_printf(LOG, "  column separator='%s'\n", col_sep.c_str());
 
+    // A chunk never holds more than a file's worth of rows
+    tabulator::Writer::ChunkPolicy chunk_policy(chunk_kb * 1024, chunk_warmup_sec, max_duration_sec);
+
     if (timeout_sec == 0.0)
         timeout_sec = std::numeric_limits<double>::max();
 
@@ -213,6 +321,16 @@ int main (int argc, char *argv[]) {
         .maskDisconnected(false)
         .exec();
 
+    // Updates are written to disk by a thread of its own, while this one receives them
+    tabulator::Writer::FlushPolicy flush_policy(flush_sec, flush_rows, flush_mb * 1024 * 1024);
+
+    tabulator::AsyncWriter async_writer(queue_size, [&](const std::string & path) {
+        return new tabulator::Writer(input_pv, path, root_group, label_sep, col_sep, flush_policy, chunk_policy,
+            compress_policy);
+    });
+
+    async_writer.start();
+
     enum StopReason stop_reason = StopReason::ERROR;
 
     try {
@@ -223,7 +341,8 @@ int main (int argc, char *argv[]) {
             epicsTimeStamp start;
             epicsTimeGetCurrent(&start);
 
-            std::unique_ptr<tabulator::Writer> writer = nullptr;
+            // Path of the current file, once the first update for it arrived
+            std::string file_path;
 
             for (;;) {
                 double elapsed_sec = seconds_since(start);
@@ -242,10 +361,10 @@ int main (int argc, char *argv[]) {
                         stop_reason = StopReason::TIMEOUT;
                         break;
 
-                    } else if (writer) {
+                    } else if (!file_path.empty()) {
                         // A file is opened and we reached the maximum duration, exit the inner loop so a new file can be generated
                         log_info_printf(LOG, "File %s has duration of %.0f sec, which meets or exceeds maximum duration of %.0f sec\n",
-                            writer->get_file_path().c_str(), elapsed_sec, max_duration_sec);
+                            file_path.c_str(), elapsed_sec, max_duration_sec);
                         break;
 
                     } else {
@@ -268,13 +387,13 @@ int main (int argc, char *argv[]) {
                             continue;
 
                         // Ensure the file is created
-                        if (!writer) {
+                        if (file_path.empty()) {
                             epicsTimeGetCurrent(&start); // reset start time so the file has a consistent duration
-                            std::string output_file = create_folder_and_file(base_directory, file_prefix, start);
-                            writer.reset(new tabulator::Writer(input_pv, output_file, root_group, label_sep, col_sep));
+                            file_path = create_folder_and_file(base_directory, file_prefix, start);
+                            async_writer.open(file_path);
                         }
 
-                        writer->write(v);
+                        async_writer.write(v);
                     }
 
                 } catch (pvxs::client::Disconnect & ex) {
@@ -283,21 +402,29 @@ int main (int argc, char *argv[]) {
                     break;
                 }
 
-                // Check if the file is larger than the max size
+                // Check if the file is larger than the max size. The writer
+                // thread may not have created it yet.
                 struct stat s = {};
-                if (stat(writer->get_file_path().c_str(), &s) < 0)
-                    throw std::runtime_error(std::string("Failed to stat output file ") + writer->get_file_path());
+                if (!file_path.empty() && stat(file_path.c_str(), &s) < 0 && errno != ENOENT)
+                    throw std::runtime_error(std::string("Failed to stat output file ") + file_path);
 
                 size_t file_size_mb = s.st_size / 1024 / 1024;
 
                 if (file_size_mb >= max_size_mb) {
                     // We reached the maximum file size, exit the inner loop so a new file can be generated
                     log_info_printf(LOG, "File %s has size %lu MB, which meets or exceeds maximum size of %lu MB\n",
-                        writer->get_file_path().c_str(), file_size_mb, max_size_mb);
+                        file_path.c_str(), file_size_mb, max_size_mb);
                     break;
                 }
             }
+
+            // Done with this file, once its queued updates are written
+            if (!file_path.empty())
+                async_writer.close();
         }
+
+        // Write whatever is still queued
+        async_writer.finish();
     } catch (std::exception & ex) {
         log_err_printf(LOG, "Exception: %s\n", ex.what());
         stop_reason = StopReason::ERROR;